@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Dedicated reserved-memory region for contiguous NPU buffers.
+ */
+
+#ifndef __LINUX_RKNPU_CARVEOUT_H
+#define __LINUX_RKNPU_CARVEOUT_H
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct rknpu_device;
+struct rknpu_mem_object;
+struct seq_file;
+
+/*
+ * rknpu carveout.
+ *
+ * @start/@size: physical range of the region.
+ * @reusable: the region is a CMA area rather than a no-map pool.
+ * @lock: protects @bos and the counters below.
+ * @bos: BOs placed in the region, by address, to find its free blocks.
+ * @allocs: BOs placed in the region.
+ * @fallbacks: contiguous BOs that did not fit and went to the system pool.
+ * @alloc_ns/@alloc_ns_max: total and worst time spent in allocations.
+ * @used: bytes of the region held by BOs.
+ * @peak: largest number of bytes in use at once.
+ */
+struct rknpu_carveout {
+	phys_addr_t start;
+	size_t size;
+	bool reusable;
+	spinlock_t lock;
+	struct list_head bos;
+	u64 allocs;
+	u64 fallbacks;
+	u64 alloc_ns;
+	u64 alloc_ns_max;
+	size_t used;
+	size_t peak;
+};
+
+int rknpu_carveout_init(struct rknpu_device *rknpu_dev);
+void rknpu_carveout_fini(struct rknpu_device *rknpu_dev);
+int rknpu_carveout_alloc(struct rknpu_device *rknpu_dev,
+			 struct rknpu_mem_object *rknpu_obj);
+void rknpu_carveout_free(struct rknpu_device *rknpu_dev,
+			 struct rknpu_mem_object *rknpu_obj);
+int rknpu_carveout_debugfs_show(struct seq_file *s, void *unused);
+
+#endif
@@ -13,14 +13,26 @@
 #include <linux/device.h>
 #include <linux/kref.h>
 #include <linux/irq.h>
+#include <linux/llist.h>
+#include <linux/maple_tree.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
 #include <linux/spinlock.h>
 #include <linux/version.h>
 #include <linux/hrtimer.h>
 #include <linux/miscdevice.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 
 #include "rknpu_job.h"
 
+struct rknpu_carveout;
+struct rknpu_iommu;
+struct rknpu_mem_evict;
+struct rknpu_mem_pool;
+struct rknpu_sram;
+
 #define DRIVER_NAME "rknpu"
 #define DRIVER_DESC "RKNPU driver"
 #define DRIVER_DATE "20240828"
@@ -58,17 +70,47 @@ struct rknpu_config {
 	__u32 core_mask;
 };
 
+#define RKNPU_LAT_HIST_BUCKETS 20
+
+/*
+ * log2 latency histogram in us: bucket 0 counts 0 us, bucket n counts
+ * [2^(n-1), 2^n) us and the last one everything above.
+ */
+struct rknpu_lat_hist {
+	u64 count[RKNPU_LAT_HIST_BUCKETS];
+};
+
 struct rknpu_timer {
 	ktime_t busy_time;
 	ktime_t total_busy_time;
 };
 
+/*
+ * Per-core state.
+ *
+ * @power_dev: power domain of the core when it is gated on its own, NULL
+ *	       when the core is powered with the NPU.
+ * @power_refcount: queued and running jobs on the core.
+ * @power_on: @power_dev is resumed, protected by core_power_lock.
+ * @power_off_work: powers @power_dev down once the core stayed idle.
+ * @power_ons: times @power_dev was resumed.
+ * @resetting: the core is being soft reset, no job is committed to it.
+ * @resets: soft resets of the core.
+ */
 struct rknpu_subcore_data {
 	struct list_head todo_list;
 	wait_queue_head_t job_done_wq;
 	struct rknpu_job *job;
 	int64_t task_num;
 	struct rknpu_timer timer;
+	struct rknpu_device *rknpu_dev;
+	struct device *power_dev;
+	atomic_t power_refcount;
+	bool power_on;
+	struct delayed_work power_off_work;
+	u64 power_ons;
+	bool resetting;
+	u64 resets;
 };
 
 /**
@@ -82,17 +124,24 @@ struct rknpu_device {
 	spinlock_t lock;
 	spinlock_t irq_lock;
 	struct mutex power_lock;
+	struct mutex core_power_lock;
 	struct mutex reset_lock;
 	struct rknpu_subcore_data subcore_datas[RKNPU_MAX_CORES];
 	const struct rknpu_config *config;
 	bool iommu_en;
 	struct reset_control **srsts;
+	u32 *srst_core_masks;
 	int num_srsts;
+	unsigned long inject_hang;
 	struct clk_bulk_data *clks;
 	int num_clks;
 	int bypass_irq_handler;
 	int bypass_soft_reset;
 	bool soft_reseting;
+	bool suspended;
+	bool suspend_powered;
+	bool suspend_power_off_pending;
+	s64 resume_ns;
 	struct device *genpd_dev_npu0;
 	struct device *genpd_dev_npu1;
 	struct device *genpd_dev_npu2;
@@ -104,16 +153,93 @@ struct rknpu_device {
 	struct hrtimer timer;
 	ktime_t kt;
 	unsigned long power_put_delay;
+	bool power_put_delay_auto;
+	ktime_t last_submit;
+	u64 submit_gap_us;
+	u64 power_on_count;
+	u64 power_on_ns;
+	u64 power_on_ns_max;
+	struct rknpu_lat_hist clk_on_hist;
+	struct rknpu_lat_hist genpd_on_hist;
+	struct rknpu_lat_hist iommu_hist;
+	struct rknpu_lat_hist power_on_hist;
+	struct rknpu_lat_hist power_off_hist;
+	struct rknpu_lat_hist core_on_hist;
+	u64 power_off_delayed;
+	atomic64_t submits;
+	atomic64_t cold_submits;
 	struct dentry *debugfs_dir;
+	struct list_head sessions;
+	struct rknpu_mem_pool *mem_pool;
+	struct rknpu_sram *sram;
+	struct rknpu_carveout *carveout;
+	struct rknpu_mem_evict *mem_evict;
+	struct rknpu_iommu *iommu;
+	struct mutex shared_lock;
+	struct list_head shared_bos;
+	u64 import_count;
+	u64 import_ns;
+	s64 import_ns_max;
+	u64 import_kmaps;
+	u64 import_cache_hits;
+	atomic64_t pmd_faults;
+	atomic64_t pmd_fault_ns;
+	struct llist_head free_list;
+	struct work_struct free_work;
+	atomic_long_t free_pending;
+	atomic_long_t free_pending_bytes;
+	atomic64_t free_deferred;
+};
+
+/* Per-session memory accounting buckets */
+enum rknpu_mem_acct {
+	RKNPU_MEM_ACCT_COHERENT,
+	RKNPU_MEM_ACCT_PAGES,
+	RKNPU_MEM_ACCT_IMPORT,
+	RKNPU_MEM_ACCT_SRAM,
+	RKNPU_MEM_ACCT_SHARED,
+	RKNPU_MEM_ACCT_USERPTR,
+	RKNPU_MEM_ACCT_NR,
 };
 
+/*
+ * rknpu session, one per open file.
+ *
+ * @list: BOs of the session, protected by rknpu_device.lock.
+ * @head: entry in rknpu_device.sessions.
+ * @mm_lock: protects @handles and @mmap_offsets and the lookups in them.
+ * @handles: handle -> BO; imports use their fd, driver BOs get one from
+ *	     RKNPU_MEM_HANDLE_MIN up.
+ * @next_handle: cyclic allocation hint for @handles.
+ * @mmap_offsets: fake mmap page offset range -> BO.
+ * @pid/@comm: process that opened the session.
+ * @nr_bos/@bytes: BOs in @list and their size per enum rknpu_mem_acct,
+ *		  protected by rknpu_device.lock.
+ * @import_cache: destroyed imports kept mapped for reuse, most recent
+ *		  first, protected by rknpu_device.lock.
+ * @nr_cached: entries in @import_cache.
+ */
 struct rknpu_session {
 	struct rknpu_device *rknpu_dev;
 	struct list_head list;
+	struct list_head head;
+	struct mutex mm_lock;
+	struct xarray handles;
+	u32 next_handle;
+	struct maple_tree mmap_offsets;
+	struct pid *pid;
+	char comm[TASK_COMM_LEN];
+	unsigned long nr_bos;
+	u64 bytes[RKNPU_MEM_ACCT_NR];
+	struct list_head import_cache;
+	unsigned int nr_cached;
 };
 
 int rknpu_power_get(struct rknpu_device *rknpu_dev);
 int rknpu_power_put(struct rknpu_device *rknpu_dev);
 int rknpu_power_put_delay(struct rknpu_device *rknpu_dev);
+int rknpu_core_power_get(struct rknpu_device *rknpu_dev, u32 core_mask);
+void rknpu_core_power_put(struct rknpu_device *rknpu_dev, u32 core_mask);
+u32 rknpu_core_power_mask(struct rknpu_device *rknpu_dev);
 
 #endif /* __LINUX_RKNPU_DRV_H_ */
@@ -56,6 +56,8 @@ enum e_rknpu_mem_type {
 	RKNPU_MEM_TRY_ALLOC_SRAM = 1 << 8,
 	RKNPU_MEM_TRY_ALLOC_NBUF = 1 << 9,
 	RKNPU_MEM_IOMMU_LIMIT_IOVA_ALIGNMENT = 1 << 10,
+	RKNPU_MEM_USERPTR = 1 << 11,
+	RKNPU_MEM_EVICTABLE = 1 << 12,
 };
 
 /* sync mode definitions. */
@@ -103,10 +105,21 @@ enum e_rknpu_action {
 	RKNPU_GET_FREE_SRAM_SIZE = 23,
 	RKNPU_GET_IOMMU_DOMAIN_ID = 24,
 	RKNPU_SET_IOMMU_DOMAIN_ID = 25,
+	RKNPU_ACT_FLUSH_FREE = 26,
 };
 
 /**
  * struct rknpu_mem_create - buffer creation information
+ *
+ * With RKNPU_MEM_USERPTR, @obj_addr holds the page-aligned user address
+ * of the memory to register on input; it is replaced by the BO on return.
+ * The pinned pages count against RLIMIT_MEMLOCK (-ENOMEM when exceeded).
+ *
+ * RKNPU_MEM_EVICTABLE (IOMMU only, implies RKNPU_MEM_NON_CONTIGUOUS) lets
+ * the driver write the BO out while it is idle; SUBMIT brings back the
+ * BOs listed in its @bo_handles, or every evicted BO of the session if the
+ * list is empty. The flag is dropped from @flags on return if
+ * it cannot be honoured.
  */
 struct rknpu_mem_create {
 	__u32 handle;
@@ -121,6 +134,9 @@ struct rknpu_mem_create {
 
 /**
  * struct rknpu_mem_map - mmap offset query
+ *
+ * mmap() at @offset plus a multiple of the page size maps the BO from
+ * that page on; the length may cover any part of the rest of the BO.
  */
 struct rknpu_mem_map {
 	__u32 handle;
@@ -148,6 +164,60 @@ struct rknpu_mem_sync {
 	__u64 size;
 };
 
+/**
+ * struct rknpu_mem_export - export a driver-allocated buffer as a DMA-BUF
+ *
+ * @obj_addr: BO returned by MEM_CREATE (Path B only).
+ * @flags: O_CLOEXEC and the access mode (O_RDONLY, O_WRONLY or O_RDWR) of
+ *	   the new file descriptor; a read-only export cannot be mmapped
+ *	   writable.
+ * @fd: returned DMA-BUF file descriptor.
+ */
+struct rknpu_mem_export {
+	__u64 obj_addr;
+	__u32 flags;
+	__s32 fd;
+};
+
+/**
+ * struct rknpu_mem_share - share a read-only constant buffer across sessions
+ *
+ * @obj_addr: BO returned by MEM_CREATE (Path B, RKNPU_MEM_NON_CONTIGUOUS).
+ * @key: SHA-256 of the whole BO (the size MEM_CREATE returned).
+ * @dma_addr: returned NPU address of the shared copy.
+ * @joined: returned 1 if an existing copy was reused, 0 if this BO
+ *	    became the shared copy.
+ * @reserved: must be zero.
+ */
+struct rknpu_mem_share {
+	__u64 obj_addr;
+	__u8 key[32];
+	__u64 dma_addr;
+	__u32 joined;
+	__u32 reserved;
+};
+
+/**
+ * struct rknpu_mem_view - create a BO for a range of an existing BO
+ *
+ * @obj_addr: BO returned by MEM_CREATE (or MEM_VIEW) to take the range of.
+ * @offset: start of the range in that BO, in bytes.
+ * @size: length of the range in bytes.
+ * @view_obj_addr: returned BO for the range; free it with MEM_DESTROY.
+ * @dma_addr: returned NPU address of the range.
+ * @handle: returned handle of the view.
+ * @reserved: must be zero.
+ */
+struct rknpu_mem_view {
+	__u64 obj_addr;
+	__u64 offset;
+	__u64 size;
+	__u64 view_obj_addr;
+	__u64 dma_addr;
+	__u32 handle;
+	__u32 reserved;
+};
+
 /**
  * struct rknpu_task - task information for register commands
  */
@@ -173,6 +243,17 @@ struct rknpu_subcore_task {
 
 /**
  * struct rknpu_submit - job submission
+ *
+ * @bo_handles: user pointer to an array of __u32 BO handles (or view
+ *		handles) the job's register commands use; evictable BOs
+ *		among them are made resident before the job runs.
+ * @bo_count: number of entries in @bo_handles, at most
+ *	      RKNPU_SUBMIT_MAX_BOS; 0 makes every evictable BO of the
+ *	      session resident.
+ * @bo_reserved: must be zero.
+ *
+ * Userspace built against an older header passes a smaller struct; the
+ * missing fields read as zero.
  */
 struct rknpu_submit {
 	__u32 flags;
@@ -189,8 +270,13 @@ struct rknpu_submit {
 	__u32 core_mask;
 	__s32 fence_fd;
 	struct rknpu_subcore_task subcore_task[5];
+	__u64 bo_handles;
+	__u32 bo_count;
+	__u32 bo_reserved;
 };
 
+#define RKNPU_SUBMIT_MAX_BOS 4096
+
 /**
  * struct rknpu_action - action (GET, SET or ACT)
  */
@@ -206,6 +292,9 @@ struct rknpu_action {
 #define RKNPU_MEM_MAP 0x03
 #define RKNPU_MEM_DESTROY 0x04
 #define RKNPU_MEM_SYNC 0x05
+#define RKNPU_MEM_EXPORT 0x06
+#define RKNPU_MEM_SHARE 0x07
+#define RKNPU_MEM_VIEW 0x08
 
 #define RKNPU_IOC_MAGIC 'r'
 #define RKNPU_IOW(nr, type) _IOW(RKNPU_IOC_MAGIC, nr, type)
@@ -220,5 +309,10 @@ struct rknpu_action {
 #define IOCTL_RKNPU_MEM_DESTROY \
 	RKNPU_IOWR(RKNPU_MEM_DESTROY, struct rknpu_mem_destroy)
 #define IOCTL_RKNPU_MEM_SYNC RKNPU_IOWR(RKNPU_MEM_SYNC, struct rknpu_mem_sync)
+#define IOCTL_RKNPU_MEM_EXPORT \
+	RKNPU_IOWR(RKNPU_MEM_EXPORT, struct rknpu_mem_export)
+#define IOCTL_RKNPU_MEM_SHARE \
+	RKNPU_IOWR(RKNPU_MEM_SHARE, struct rknpu_mem_share)
+#define IOCTL_RKNPU_MEM_VIEW RKNPU_IOWR(RKNPU_MEM_VIEW, struct rknpu_mem_view)
 
 #endif
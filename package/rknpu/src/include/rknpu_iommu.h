@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Save and restore of the NPU's MMU state across power cycles.
+ */
+
+#ifndef __LINUX_RKNPU_IOMMU_H
+#define __LINUX_RKNPU_IOMMU_H
+
+#include <linux/bits.h>
+#include <linux/types.h>
+
+struct rknpu_device;
+struct seq_file;
+
+/* MMU instances: two in front of core 0, one per other core */
+#define RKNPU_MMU_MAX 4
+#define RKNPU_MMU0_OFFSET 0x9000
+#define RKNPU_MMU_OFFSET 0xa000
+
+/* rockchip-iommu register layout */
+#define RKNPU_MMU_DTE_ADDR 0x00
+#define RKNPU_MMU_STATUS 0x04
+#define RKNPU_MMU_COMMAND 0x08
+#define RKNPU_MMU_INT_MASK 0x1c
+
+#define RKNPU_MMU_STATUS_PAGING_ENABLED BIT(0)
+
+#define RKNPU_MMU_CMD_ENABLE_PAGING 0
+#define RKNPU_MMU_CMD_ZAP_CACHE 4
+
+/* Page fault and bus error */
+#define RKNPU_MMU_IRQ_MASK 0x3
+
+/*
+ * rknpu MMU state.
+ *
+ * @num_mmu: MMU instances in @base.
+ * @base: register window of each instance.
+ * @core: core whose power domain each instance sits in.
+ * @dte: page directory address shared by all instances, 0 until saved.
+ * @retained: power-ups that found the MMUs still programmed.
+ * @restores: power-ups that reprogrammed them from @dte.
+ * @reattaches: power-ups without a saved state, handled by re-attaching
+ *		the domain.
+ * @failures: MMUs that did not enable paging after a restore.
+ */
+struct rknpu_iommu {
+	unsigned int num_mmu;
+	void __iomem *base[RKNPU_MMU_MAX];
+	int core[RKNPU_MMU_MAX];
+	u32 dte;
+	u64 retained;
+	u64 restores;
+	u64 reattaches;
+	u64 failures;
+};
+
+int rknpu_iommu_init(struct rknpu_device *rknpu_dev);
+void rknpu_iommu_fini(struct rknpu_device *rknpu_dev);
+void rknpu_iommu_save(struct rknpu_device *rknpu_dev, u32 core_mask);
+int rknpu_iommu_restore(struct rknpu_device *rknpu_dev, u32 core_mask);
+bool rknpu_iommu_saved(struct rknpu_device *rknpu_dev);
+int rknpu_iommu_debugfs_show(struct seq_file *s, void *unused);
+
+#endif
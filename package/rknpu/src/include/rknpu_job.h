@@ -25,6 +25,7 @@
 
 /* Forward declarations */
 struct rknpu_device;
+struct rknpu_mem_resident;
 
 struct rknpu_job {
 	struct rknpu_device *rknpu_dev;
@@ -47,6 +48,9 @@ struct rknpu_job {
 	ktime_t hw_recoder_time;
 	ktime_t hw_elapse_time;
 	atomic_t submit_count[RKNPU_MAX_CORES];
+	struct rknpu_mem_resident *resident;
+	u32 power_mask;
+	bool power_held;
 };
 
 irqreturn_t rknpu_core0_irq_handler(int irq, void *data);
@@ -55,6 +59,9 @@ irqreturn_t rknpu_core2_irq_handler(int irq, void *data);
 
 int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 		       unsigned int cmd, unsigned long data);
+int rknpu_job_suspend(struct rknpu_device *rknpu_dev);
+void rknpu_job_resume(struct rknpu_device *rknpu_dev);
+void rknpu_job_fail_queued(struct rknpu_device *rknpu_dev, int ret);
 
 int rknpu_get_hw_version(struct rknpu_device *rknpu_dev, uint32_t *version);
 int rknpu_clear_rw_amount(struct rknpu_device *rknpu_dev);
@@ -5,7 +5,9 @@
  *
  * Memory allocator supporting two paths:
  * - DMA-BUF import (handle > 0): SDK allocates from /dev/dma_heap, passes fd
- * - dma_alloc_coherent (handle = 0): NIF uses kernel-allocated coherent memory
+ * - dma_alloc_coherent (handle = 0): NIF uses kernel-allocated coherent memory,
+ *   or individual pages mapped through the IOMMU with RKNPU_MEM_NON_CONTIGUOUS,
+ *   or pinned user memory with RKNPU_MEM_USERPTR
  */
 
 #ifndef __LINUX_RKNPU_MEM_H
@@ -13,8 +15,29 @@
 
 #include <linux/mm_types.h>
 #include <linux/dma-buf.h>
+#include <linux/dma-direction.h>
+#include <linux/kref.h>
+#include <linux/llist.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
 
 struct rknpu_device;
+struct rknpu_mem_shared;
+struct rknpu_session;
+struct seq_file;
+
+/* Handles of driver-allocated BOs; lower values are imported DMA-BUF fds */
+#define RKNPU_MEM_HANDLE_MIN 0x80000000U
+
+/*
+ * Fake mmap offsets start at 1 TiB so they never collide with the 40-bit
+ * dma_addr legacy userspace passes to mmap directly.
+ */
+#define RKNPU_MEM_MMAP_PGOFF_MIN (1UL << (40 - PAGE_SHIFT))
+#define RKNPU_MEM_MMAP_PGOFF_MAX (ULONG_MAX >> (PAGE_SHIFT + 1))
+
+/* Physically contiguous chunk sizes tried for page-array BOs, largest first */
+#define RKNPU_MEM_NR_CHUNK_SIZES 3
 
 /*
  * rknpu DMA buffer structure.
@@ -25,8 +48,41 @@ struct rknpu_device;
  * @head: list entry for session tracking.
  * @dmabuf: DMA-BUF reference (import path only).
  * @attachment: DMA-BUF attachment (import path only).
- * @sgt: scatter-gather table (import path only).
+ * @sgt: scatter-gather table (import path, or driver-owned page array).
  * @owner: 1 = driver allocated (dma_alloc_coherent), 0 = imported DMA-BUF.
+ * @flags: RKNPU_MEM_* flags the BO was created with.
+ * @pages: backing pages (RKNPU_MEM_NON_CONTIGUOUS only, NULL otherwise);
+ *	   pinned user pages with RKNPU_MEM_USERPTR.
+ * @num_pages: number of entries in @pages.
+ * @nr_chunks: chunks allocated per size in rknpu_mem_chunk_sizes[].
+ * @sram_size: bytes at the start of the BO backed by on-chip SRAM; the
+ *	       matching @pages entries are a placeholder, not owned.
+ * @sram_phys: physical address of that SRAM.
+ * @carveout: contiguous BO allocated through rknpu_carveout_alloc().
+ * @carveout_phys: physical address of such a BO if it landed in the
+ *		   region, 0 if it fell back to the system pool.
+ * @carveout_head: entry in rknpu_carveout.bos while in the region.
+ * @rknpu_dev: owning device, needed once the last reference is dropped.
+ * @refcount: session reference plus one per exported DMA-BUF.
+ * @export_lock: protects @attachments, serializes MEM_EXPORT and MEM_SHARE
+ *		 and the lazy kernel mapping of imports.
+ * @attachments: importers of DMA-BUFs exported from this BO.
+ * @shared: read-only copy shared between sessions after MEM_SHARE; @pages,
+ *	    @sgt and @kv_addr then belong to its backing BO.
+ * @handle: handle in the owning session (MEM_MAP looks BOs up by it).
+ * @mmap_pgoff: first page of the BO's fake mmap offset range.
+ * @parent: for a view (MEM_VIEW), the BO it is a range of; the view holds
+ *	    a reference and owns no memory.
+ * @offset: start of a view in @parent.
+ * @free_node: entry in rknpu_device.free_list once the last reference is
+ *	       gone.
+ * @evict_head: entry in the eviction LRU (RKNPU_MEM_EVICTABLE only).
+ * @evicted: contents are in @backup; @pages entries are NULL, @kv_addr is
+ *	     unset and @sgt describes the scratch page the IOVA points to.
+ * @pin_count: SUBMITs that need the BO resident.
+ * @backup: shmem copy while evicted.
+ * The eviction fields, @pages, @sgt and @kv_addr of evictable BOs are
+ * protected by rknpu_mem_evict.lock.
  */
 struct rknpu_mem_object {
 	unsigned long size;
@@ -36,13 +92,75 @@ struct rknpu_mem_object {
 	struct dma_buf *dmabuf;
 	struct dma_buf_attachment *attachment;
 	struct sg_table *sgt;
+	enum dma_data_direction dma_dir;
 	int owner;
+	unsigned int flags;
+	struct page **pages;
+	unsigned long num_pages;
+	struct mm_struct *pin_mm;
+	unsigned long nr_chunks[RKNPU_MEM_NR_CHUNK_SIZES];
+	size_t sram_size;
+	phys_addr_t sram_phys;
+	bool carveout;
+	phys_addr_t carveout_phys;
+	struct list_head carveout_head;
+	struct rknpu_device *rknpu_dev;
+	struct kref refcount;
+	struct mutex export_lock;
+	struct list_head attachments;
+	struct rknpu_mem_shared *shared;
+	u32 handle;
+	unsigned long mmap_pgoff;
+	struct rknpu_mem_object *parent;
+	unsigned long offset;
+	struct llist_node free_node;
+	struct list_head evict_head;
+	bool evicted;
+	unsigned int pin_count;
+	struct file *backup;
 };
 
 int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			   unsigned int cmd, unsigned long data);
 int rknpu_mem_destroy_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			    unsigned long data);
-int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, unsigned long data);
+int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			 unsigned long data);
+int rknpu_mem_view_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			 unsigned long data);
+
+int rknpu_mem_export_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			   unsigned long data);
+int rknpu_mem_share_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			  unsigned long data);
+void rknpu_mem_shared_put(struct rknpu_mem_shared *shared);
+
+int rknpu_mem_mmap_obj(struct rknpu_device *rknpu_dev,
+		       struct rknpu_mem_object *rknpu_obj,
+		       struct vm_area_struct *vma);
+struct rknpu_mem_object *rknpu_mem_obj_lookup(struct rknpu_device *rknpu_dev,
+					      struct file *file,
+					      __u64 obj_addr);
+struct rknpu_mem_object *
+rknpu_mem_obj_lookup_handle(struct rknpu_session *session, u32 handle);
+struct rknpu_mem_object *
+rknpu_mem_obj_lookup_pgoff(struct rknpu_session *session, unsigned long pgoff);
+int rknpu_mem_kmap(struct rknpu_mem_object *rknpu_obj);
+void rknpu_mem_session_account(struct rknpu_session *session,
+			       struct rknpu_mem_object *rknpu_obj, int sign);
+void rknpu_mem_obj_get(struct rknpu_mem_object *rknpu_obj);
+void rknpu_mem_obj_put(struct rknpu_mem_object *rknpu_obj);
+void rknpu_mem_free_work(struct work_struct *work);
+void rknpu_mem_flush_free(struct rknpu_device *rknpu_dev);
+int rknpu_mem_fill_pages(struct rknpu_device *rknpu_dev,
+			 struct rknpu_mem_object *rknpu_obj);
+void *rknpu_mem_vmap_pages(struct rknpu_mem_object *rknpu_obj);
+struct rknpu_mem_object *
+rknpu_mem_obj_create_pages(struct rknpu_device *rknpu_dev, size_t size,
+			   unsigned int flags, enum dma_data_direction dir);
+
+int rknpu_mem_debugfs_show(struct seq_file *s, void *unused);
+int rknpu_mem_shared_debugfs_show(struct seq_file *s, void *unused);
+int rknpu_mem_sessions_debugfs_show(struct seq_file *s, void *unused);
 
 #endif
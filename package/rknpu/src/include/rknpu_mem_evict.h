@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Eviction of idle RKNPU_MEM_EVICTABLE BOs (model weights) to shmem.
+ */
+
+#ifndef __LINUX_RKNPU_MEM_EVICT_H
+#define __LINUX_RKNPU_MEM_EVICT_H
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+struct page;
+struct rknpu_device;
+struct rknpu_mem_object;
+struct rknpu_session;
+struct seq_file;
+
+/*
+ * rknpu eviction state.
+ *
+ * @lock: protects the LRU, the residency of every evictable BO (@pages,
+ *	  @sgt, @kv_addr, @evicted, @pin_count, @backup) and the counters.
+ * @lru: evictable BOs, least recently used first.
+ * @scratch: zeroed page the IOVA range of an evicted BO points to.
+ * @resident/@evicted: bytes of evictable BOs in memory and in shmem.
+ * @evictions/@restores: BOs written out and brought back so far.
+ * @restore_ns/@restore_ns_max: total and worst time spent restoring.
+ * @failures: evictions or restores that ran out of memory.
+ */
+struct rknpu_mem_evict {
+	struct mutex lock;
+	struct list_head lru;
+	struct page *scratch;
+	size_t resident;
+	size_t evicted;
+	u64 evictions;
+	u64 restores;
+	u64 restore_ns;
+	u64 restore_ns_max;
+	u64 failures;
+};
+
+/*
+ * Evictable BOs pinned in memory for one SUBMIT; the job holds it until it
+ * is freed.
+ */
+struct rknpu_mem_resident {
+	struct rknpu_device *rknpu_dev;
+	unsigned int nr;
+	struct rknpu_mem_object *objs[];
+};
+
+int rknpu_mem_evict_init(struct rknpu_device *rknpu_dev);
+void rknpu_mem_evict_fini(struct rknpu_device *rknpu_dev);
+void rknpu_mem_evict_add(struct rknpu_mem_object *rknpu_obj);
+void rknpu_mem_evict_del(struct rknpu_mem_object *rknpu_obj);
+int rknpu_mem_evict_restore(struct rknpu_mem_object *rknpu_obj);
+struct rknpu_mem_resident *
+rknpu_mem_make_resident(struct rknpu_session *session, const u32 *handles,
+			unsigned int count);
+void rknpu_mem_resident_put(struct rknpu_mem_resident *resident);
+int rknpu_mem_evict_debugfs_show(struct seq_file *s, void *unused);
+
+#endif
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Recycling pool for freed dma_alloc_coherent BOs, plus a reserve of
+ * pages cleared in the background for page-array allocations.
+ */
+
+#ifndef __LINUX_RKNPU_MEM_POOL_H
+#define __LINUX_RKNPU_MEM_POOL_H
+
+#include <linux/list.h>
+#include <linux/sizes.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+/* Buckets cover PAGE_SIZE << 0 .. PAGE_SIZE << (RKNPU_MEM_POOL_BUCKETS - 1) */
+#define RKNPU_MEM_POOL_BUCKETS 16
+
+/* Chunk size kept pre-zeroed for page-array BOs */
+#define RKNPU_MEM_ZERO_CHUNK SZ_64K
+
+struct rknpu_device;
+struct rknpu_mem_object;
+struct seq_file;
+struct shrinker;
+
+/*
+ * rknpu BO pool.
+ *
+ * @lock: protects the lists and counters below.
+ * @buckets: free BOs, bucket n holds sizes in [PAGE_SIZE << n, PAGE_SIZE << (n + 1)).
+ * @lru: all pooled BOs, oldest first; used for cap enforcement and shrinking.
+ * @bytes: total size of pooled BOs.
+ * @max_bytes: pool cap; 0 disables recycling.
+ * @hits/@misses: MEM_CREATE lookups served / not served from the pool.
+ * @evicted: BOs freed to stay under @max_bytes.
+ * @shrunk: BOs freed by the shrinker.
+ * @zero_work: clears pooled BOs and refills @zero_chunks in the background.
+ * @zero_chunks: pre-zeroed RKNPU_MEM_ZERO_CHUNK page blocks.
+ * @zero_nr/@zero_target: blocks in @zero_chunks / blocks to keep there.
+ * @zero_bg_bytes: bytes cleared by @zero_work.
+ * @zero_sync_bytes: bytes that had to be cleared inside MEM_CREATE.
+ * @zero_hits: blocks handed out from @zero_chunks.
+ */
+struct rknpu_mem_pool {
+	struct rknpu_device *rknpu_dev;
+	spinlock_t lock;
+	struct list_head buckets[RKNPU_MEM_POOL_BUCKETS];
+	struct list_head lru;
+	size_t bytes;
+	size_t max_bytes;
+	unsigned long count[RKNPU_MEM_POOL_BUCKETS];
+	u64 hits;
+	u64 misses;
+	u64 evicted;
+	u64 shrunk;
+	struct shrinker *shrinker;
+	struct work_struct zero_work;
+	struct list_head zero_chunks;
+	unsigned long zero_nr;
+	unsigned long zero_target;
+	u64 zero_bg_bytes;
+	u64 zero_sync_bytes;
+	u64 zero_hits;
+};
+
+int rknpu_mem_pool_init(struct rknpu_device *rknpu_dev);
+void rknpu_mem_pool_fini(struct rknpu_device *rknpu_dev);
+bool rknpu_mem_pool_get(struct rknpu_device *rknpu_dev,
+			struct rknpu_mem_object *rknpu_obj, size_t size);
+struct page *rknpu_mem_pool_get_zeroed(struct rknpu_device *rknpu_dev);
+bool rknpu_mem_pool_put(struct rknpu_device *rknpu_dev,
+			struct rknpu_mem_object *rknpu_obj);
+int rknpu_mem_pool_debugfs_show(struct seq_file *s, void *unused);
+
+#endif
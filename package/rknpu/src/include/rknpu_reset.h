@@ -11,7 +11,11 @@
 
 #include "rknpu_drv.h"
 
+struct seq_file;
+
 int rknpu_reset_get(struct rknpu_device *rknpu_dev);
 int rknpu_soft_reset(struct rknpu_device *rknpu_dev);
+int rknpu_soft_reset_cores(struct rknpu_device *rknpu_dev, u32 *reset_mask);
+int rknpu_reset_debugfs_show(struct seq_file *s, void *unused);
 
 #endif
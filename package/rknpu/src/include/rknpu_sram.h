@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * On-chip SRAM allocator for RKNPU_MEM_TRY_ALLOC_SRAM buffers.
+ */
+
+#ifndef __LINUX_RKNPU_SRAM_H
+#define __LINUX_RKNPU_SRAM_H
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct gen_pool;
+struct page;
+struct rknpu_device;
+struct rknpu_mem_object;
+struct seq_file;
+
+/*
+ * rknpu SRAM region.
+ *
+ * @pool: genalloc over the physical SRAM range, page granular.
+ * @start/@size: physical SRAM range handed to the NPU.
+ * @base: CPU mapping of the region, only used to clear it.
+ * @emulated: normal pages backing @pool when no SRAM node exists (testing).
+ * @scratch: page the SRAM part of an IOVA range is first mapped to.
+ * @lock: protects the counters below.
+ * @allocs: BOs placed (fully or partly) in SRAM.
+ * @partial: BOs that only got part of their size in SRAM.
+ * @fallbacks: TRY_ALLOC_SRAM requests served entirely from DDR.
+ * @peak: largest number of SRAM bytes in use at once.
+ */
+struct rknpu_sram {
+	struct gen_pool *pool;
+	phys_addr_t start;
+	size_t size;
+	void __iomem *base;
+	void *emulated;
+	struct page *scratch;
+	spinlock_t lock;
+	u64 allocs;
+	u64 partial;
+	u64 fallbacks;
+	size_t peak;
+};
+
+int rknpu_sram_init(struct rknpu_device *rknpu_dev);
+void rknpu_sram_fini(struct rknpu_device *rknpu_dev);
+size_t rknpu_sram_total_size(struct rknpu_device *rknpu_dev);
+size_t rknpu_sram_free_size(struct rknpu_device *rknpu_dev);
+size_t rknpu_sram_alloc(struct rknpu_device *rknpu_dev, size_t size,
+			phys_addr_t *phys);
+void rknpu_sram_free(struct rknpu_device *rknpu_dev, phys_addr_t phys,
+		     size_t size);
+int rknpu_sram_map(struct rknpu_device *rknpu_dev,
+		   struct rknpu_mem_object *rknpu_obj);
+int rknpu_sram_debugfs_show(struct seq_file *s, void *unused);
+
+#endif
@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Dedicated reserved-memory region for contiguous NPU buffers.
+ *
+ * Contiguous BOs otherwise come from dma_alloc_coherent() and, without
+ * the IOMMU, from the global CMA area that video decoders and display
+ * also allocate from; model loads then stall on page migration. A
+ * `memory-region` phandle gives the NPU its own range: the region is
+ * attached with of_reserved_mem_device_init(), so dma_alloc_coherent()
+ * itself draws from it, either as a no-map shared-dma-pool or as a
+ * reusable (per-device CMA) region. The DMA core falls back to the system
+ * pool when a BO does not fit. What is left here is the bookkeeping of
+ * which BOs landed in the region.
+ */
+
+#include <linux/dma-mapping.h>
+#include <linux/iommu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "rknpu_carveout.h"
+#include "rknpu_drv.h"
+#include "rknpu_mem.h"
+
+int rknpu_carveout_init(struct rknpu_device *rknpu_dev)
+{
+	struct device *dev = rknpu_dev->dev;
+	struct rknpu_carveout *carveout;
+	struct reserved_mem *rmem;
+	struct device_node *node;
+	bool reusable;
+	int ret;
+
+	node = of_parse_phandle(dev->of_node, "memory-region", 0);
+	if (!node)
+		return 0;
+
+	rmem = of_reserved_mem_lookup(node);
+	reusable = of_property_read_bool(node, "reusable");
+	of_node_put(node);
+
+	if (!rmem) {
+		LOG_DEV_WARN(dev, "memory-region is not reserved memory, ignored\n");
+		return 0;
+	}
+
+	/*
+	 * A no-map pool hands out its physical addresses as DMA addresses,
+	 * which the IOMMU would translate; only CMA works behind it.
+	 */
+	if (!reusable && rknpu_dev->iommu_en) {
+		LOG_DEV_WARN(dev, "no-map memory-region needs the IOMMU off, use a reusable region; ignored\n");
+		return 0;
+	}
+
+	carveout = kzalloc(sizeof(*carveout), GFP_KERNEL);
+	if (!carveout)
+		return -ENOMEM;
+
+	ret = of_reserved_mem_device_init(dev);
+	if (ret) {
+		LOG_DEV_WARN(dev, "cannot attach memory-region (%d), ignored\n",
+			     ret);
+		kfree(carveout);
+		return 0;
+	}
+
+	carveout->start = rmem->base;
+	carveout->size = rmem->size;
+	carveout->reusable = reusable;
+	spin_lock_init(&carveout->lock);
+	INIT_LIST_HEAD(&carveout->bos);
+	rknpu_dev->carveout = carveout;
+
+	LOG_DEV_INFO(dev, "carveout: %pa size %zu%s\n", &carveout->start,
+		     carveout->size, reusable ? " (cma)" : "");
+
+	return 0;
+}
+
+/* All carveout BOs must have been released */
+void rknpu_carveout_fini(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_carveout *carveout = rknpu_dev->carveout;
+
+	if (!carveout)
+		return;
+
+	rknpu_dev->carveout = NULL;
+
+	of_reserved_mem_device_release(rknpu_dev->dev);
+	kfree(carveout);
+}
+
+/* Physical address behind a coherent BO's DMA address */
+static phys_addr_t rknpu_carveout_phys(struct rknpu_device *rknpu_dev,
+				       dma_addr_t dma_addr)
+{
+	struct iommu_domain *domain;
+
+	if (!rknpu_dev->iommu_en)
+		return dma_addr;
+
+	domain = iommu_get_domain_for_dev(rknpu_dev->dev);
+	return domain ? iommu_iova_to_phys(domain, dma_addr) : 0;
+}
+
+/*
+ * Allocate a contiguous BO of rknpu_obj->size bytes, from the carveout
+ * when it fits. Behind the IOMMU the allocation must be forced contiguous
+ * or the DMA core would not use the device's CMA area. The memory is
+ * cleared like any dma_alloc_coherent() memory. Returns -ENODEV without a
+ * carveout, the caller then allocates as usual.
+ */
+int rknpu_carveout_alloc(struct rknpu_device *rknpu_dev,
+			 struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_carveout *carveout = rknpu_dev->carveout;
+	struct list_head *pos;
+	ktime_t start = ktime_get();
+	phys_addr_t phys;
+	bool inside;
+	s64 ns;
+
+	if (!carveout)
+		return -ENODEV;
+
+	rknpu_obj->kv_addr = dma_alloc_attrs(rknpu_dev->dev, rknpu_obj->size,
+					     &rknpu_obj->dma_addr,
+					     GFP_KERNEL_ACCOUNT,
+					     DMA_ATTR_FORCE_CONTIGUOUS);
+	if (!rknpu_obj->kv_addr)
+		return -ENOMEM;
+
+	phys = rknpu_carveout_phys(rknpu_dev, rknpu_obj->dma_addr);
+	inside = phys >= carveout->start &&
+		 phys - carveout->start < carveout->size;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&carveout->lock);
+	if (inside) {
+		carveout->allocs++;
+		carveout->alloc_ns += ns;
+		carveout->alloc_ns_max = max_t(u64, carveout->alloc_ns_max,
+					       ns);
+		carveout->used += rknpu_obj->size;
+		carveout->peak = max(carveout->peak, carveout->used);
+
+		/* Keep @bos sorted, the first BO above goes after us */
+		list_for_each(pos, &carveout->bos) {
+			if (list_entry(pos, struct rknpu_mem_object,
+				       carveout_head)->carveout_phys > phys)
+				break;
+		}
+		list_add_tail(&rknpu_obj->carveout_head, pos);
+	} else {
+		carveout->fallbacks++;
+	}
+	spin_unlock(&carveout->lock);
+
+	rknpu_obj->carveout = true;
+	rknpu_obj->carveout_phys = inside ? phys : 0;
+
+	return 0;
+}
+
+void rknpu_carveout_free(struct rknpu_device *rknpu_dev,
+			 struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_carveout *carveout = rknpu_dev->carveout;
+
+	dma_free_attrs(rknpu_dev->dev, rknpu_obj->size, rknpu_obj->kv_addr,
+		       rknpu_obj->dma_addr, DMA_ATTR_FORCE_CONTIGUOUS);
+
+	if (rknpu_obj->carveout_phys) {
+		spin_lock(&carveout->lock);
+		carveout->used -= rknpu_obj->size;
+		list_del(&rknpu_obj->carveout_head);
+		spin_unlock(&carveout->lock);
+	}
+}
+
+/*
+ * Free blocks of the region, from the gaps between its BOs. The kernel
+ * keeps the allocation bitmap of a CMA area to itself, so this is the
+ * driver's view: in a reusable region, movable pages the kernel has put
+ * there count as free since CMA migrates them away on allocation.
+ */
+static void rknpu_carveout_free_blocks(struct rknpu_carveout *carveout,
+				       size_t *largest, unsigned int *blocks)
+{
+	struct rknpu_mem_object *rknpu_obj;
+	phys_addr_t end = carveout->start;
+	size_t gap;
+
+	*largest = 0;
+	*blocks = 0;
+
+	list_for_each_entry(rknpu_obj, &carveout->bos, carveout_head) {
+		gap = rknpu_obj->carveout_phys - end;
+		if (gap) {
+			*largest = max(*largest, gap);
+			(*blocks)++;
+		}
+		end = rknpu_obj->carveout_phys + rknpu_obj->size;
+	}
+
+	gap = carveout->start + carveout->size - end;
+	if (gap) {
+		*largest = max(*largest, gap);
+		(*blocks)++;
+	}
+}
+
+int rknpu_carveout_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct rknpu_carveout *carveout;
+	unsigned int free_blocks;
+	size_t largest, free;
+
+	if (!rknpu_dev || !rknpu_dev->carveout) {
+		seq_puts(s, "no carveout\n");
+		return 0;
+	}
+
+	carveout = rknpu_dev->carveout;
+
+	seq_printf(s, "region: %pa %zu%s\n", &carveout->start, carveout->size,
+		   carveout->reusable ? " cma" : "");
+
+	spin_lock(&carveout->lock);
+	rknpu_carveout_free_blocks(carveout, &largest, &free_blocks);
+	free = carveout->size - carveout->used;
+	seq_printf(s, "used: %zu / %zu\n", carveout->used, carveout->size);
+	seq_printf(s, "peak: %zu\n", carveout->peak);
+	seq_printf(s, "free_blocks: %u\n", free_blocks);
+	seq_printf(s, "largest_free_block: %zu\n", largest);
+	/* Share of the free space outside the largest free block */
+	seq_printf(s, "fragmentation: %llu%%\n",
+		   free ? div64_u64((u64)(free - largest) * 100, free) : 0);
+	seq_printf(s, "allocs: %llu\n", carveout->allocs);
+	seq_printf(s, "fallbacks: %llu\n", carveout->fallbacks);
+	seq_printf(s, "alloc_avg_us: %llu\n",
+		   carveout->allocs ?
+			   div64_u64(carveout->alloc_ns,
+				     carveout->allocs * NSEC_PER_USEC) : 0);
+	seq_printf(s, "alloc_max_us: %llu\n",
+		   carveout->alloc_ns_max / NSEC_PER_USEC);
+	spin_unlock(&carveout->lock);
+
+	return 0;
+}
@@ -5,7 +5,7 @@
  *
  * Simplified for mainline Linux 6.18:
  * - No DRM GEM, no rk_dma_heap — uses dma_alloc_coherent()
- * - No devfreq, no fence, no SRAM, no NBUF
+ * - No devfreq, no fence, no NBUF
  * - No rockchip_iommu_is_enabled() — checks DT iommus property
  * - No regulator management — relies on clk_ignore_unused cmdline
  * - Misc device only (/dev/rknpu)
@@ -17,6 +17,7 @@
 #include <linux/iosys-map.h>
 #include <linux/iommu.h>
 #include <linux/interrupt.h>
+#include <linux/mman.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
@@ -35,9 +36,14 @@
 #include <linux/seq_file.h>
 
 #include "rknpu_ioctl.h"
+#include "rknpu_iommu.h"
 #include "rknpu_reset.h"
 #include "rknpu_drv.h"
 #include "rknpu_mem.h"
+#include "rknpu_mem_evict.h"
+#include "rknpu_mem_pool.h"
+#include "rknpu_sram.h"
+#include "rknpu_carveout.h"
 #include "rknpu_job.h"
 
 #define RKNPU_GET_DRV_VERSION_STRING(MAJOR, MINOR, PATCHLEVEL) \
@@ -48,6 +54,10 @@
 /* RKNPU load interval: 1000ms */
 #define RKNPU_LOAD_INTERVAL 1000000000
 
+/* Bounds of the learned power off delay */
+#define RKNPU_POWER_DELAY_MIN_MS 10
+#define RKNPU_POWER_DELAY_MAX_MS 3000
+
 static int bypass_irq_handler;
 module_param(bypass_irq_handler, int, 0644);
 MODULE_PARM_DESC(bypass_irq_handler,
@@ -58,6 +68,11 @@ module_param(bypass_soft_reset, int, 0644);
 MODULE_PARM_DESC(bypass_soft_reset,
 		 "bypass RKNPU soft reset if set it to 1, disabled by default");
 
+static unsigned int core_idle_ms = 100;
+module_param(core_idle_ms, uint, 0644);
+MODULE_PARM_DESC(core_idle_ms,
+		 "power down an idle RKNPU core after this many ms, 100 by default");
+
 /* IRQ handler declarations */
 static const struct rknpu_irqs_data rk3588_npu_irqs[] = {
 	{ "npu0_irq", rknpu_core0_irq_handler },
@@ -94,6 +109,14 @@ static int rknpu_get_drv_version(uint32_t *version)
 	return 0;
 }
 
+static void rknpu_lat_hist_add(struct rknpu_lat_hist *hist, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+
+	hist->count[min_t(int, us > 0 ? fls64(us) : 0,
+			  RKNPU_LAT_HIST_BUCKETS - 1)]++;
+}
+
 /* Forward declarations */
 static int rknpu_power_on(struct rknpu_device *rknpu_dev);
 static int rknpu_power_off(struct rknpu_device *rknpu_dev);
@@ -109,6 +132,8 @@ static void rknpu_power_off_delay_work(struct work_struct *power_off_work)
 		ret = rknpu_power_off(rknpu_dev);
 		if (ret)
 			atomic_inc(&rknpu_dev->power_refcount);
+		else
+			rknpu_dev->power_off_delayed++;
 	}
 	mutex_unlock(&rknpu_dev->power_lock);
 
@@ -116,13 +141,25 @@ static void rknpu_power_off_delay_work(struct work_struct *power_off_work)
 		rknpu_power_put_delay(rknpu_dev);
 }
 
+/*
+ * power_refcount only becomes non-zero once the NPU is on and only drops
+ * to zero under power_lock, so while it is non-zero references can be
+ * taken and dropped without the lock. The lock is only needed for the
+ * transitions from and to zero.
+ */
 int rknpu_power_get(struct rknpu_device *rknpu_dev)
 {
 	int ret = 0;
 
+	if (atomic_inc_not_zero(&rknpu_dev->power_refcount))
+		return 0;
+
 	mutex_lock(&rknpu_dev->power_lock);
-	if (atomic_inc_return(&rknpu_dev->power_refcount) == 1)
+	if (atomic_read(&rknpu_dev->power_refcount) == 0)
 		ret = rknpu_power_on(rknpu_dev);
+	/* No reference on failure: the NPU must not count as on */
+	if (!ret)
+		atomic_inc(&rknpu_dev->power_refcount);
 	mutex_unlock(&rknpu_dev->power_lock);
 
 	return ret;
@@ -132,6 +169,10 @@ int rknpu_power_put(struct rknpu_device *rknpu_dev)
 {
 	int ret = 0;
 
+	/* Not the last reference */
+	if (atomic_add_unless(&rknpu_dev->power_refcount, -1, 1))
+		return 0;
+
 	mutex_lock(&rknpu_dev->power_lock);
 	if (atomic_dec_if_positive(&rknpu_dev->power_refcount) == 0) {
 		ret = rknpu_power_off(rknpu_dev);
@@ -146,16 +187,55 @@ int rknpu_power_put(struct rknpu_device *rknpu_dev)
 	return ret;
 }
 
+/*
+ * Learn the power off delay from the gaps between submits. The NPU stays
+ * on across gaps up to twice their moving average, so bursts keep it
+ * powered, while traffic too sparse for that drops to the minimum instead
+ * of idling powered for seconds after each job. Single gaps are capped so
+ * one long pause does not keep the next burst paying power-ups.
+ */
+static void rknpu_power_note_submit(struct rknpu_device *rknpu_dev)
+{
+	ktime_t now = ktime_get();
+	unsigned long delay;
+	s64 gap, avg;
+
+	spin_lock(&rknpu_dev->lock);
+	if (rknpu_dev->last_submit) {
+		gap = min_t(s64, ktime_us_delta(now, rknpu_dev->last_submit),
+			    2 * RKNPU_POWER_DELAY_MAX_MS * USEC_PER_MSEC);
+		avg = rknpu_dev->submit_gap_us;
+		rknpu_dev->submit_gap_us = avg ? avg + (gap - avg) / 4 : gap;
+	}
+	rknpu_dev->last_submit = now;
+
+	if (rknpu_dev->power_put_delay_auto && rknpu_dev->submit_gap_us) {
+		delay = 2 * rknpu_dev->submit_gap_us / USEC_PER_MSEC;
+		if (delay > RKNPU_POWER_DELAY_MAX_MS)
+			delay = RKNPU_POWER_DELAY_MIN_MS;
+		WRITE_ONCE(rknpu_dev->power_put_delay,
+			   max_t(unsigned long, delay,
+				 RKNPU_POWER_DELAY_MIN_MS));
+	}
+	spin_unlock(&rknpu_dev->lock);
+}
+
 int rknpu_power_put_delay(struct rknpu_device *rknpu_dev)
 {
-	if (rknpu_dev->power_put_delay == 0)
+	unsigned long delay = READ_ONCE(rknpu_dev->power_put_delay);
+
+	if (delay == 0)
 		return rknpu_power_put(rknpu_dev);
 
+	/* Not the last reference */
+	if (atomic_add_unless(&rknpu_dev->power_refcount, -1, 1))
+		return 0;
+
 	mutex_lock(&rknpu_dev->power_lock);
 	if (atomic_read(&rknpu_dev->power_refcount) == 1)
 		queue_delayed_work(
 			rknpu_dev->power_off_wq, &rknpu_dev->power_off_work,
-			msecs_to_jiffies(rknpu_dev->power_put_delay));
+			msecs_to_jiffies(delay));
 	else
 		atomic_dec_if_positive(&rknpu_dev->power_refcount);
 	mutex_unlock(&rknpu_dev->power_lock);
@@ -163,6 +243,116 @@ int rknpu_power_put_delay(struct rknpu_device *rknpu_dev)
 	return 0;
 }
 
+/*
+ * Cores 1 and 2 have power domains of their own and are only powered
+ * while jobs are queued on them, plus core_idle_ms to absorb bursts. Core
+ * 0's domain holds the registers shared by all cores and the first MMUs,
+ * so it is powered with the NPU by rknpu_power_on().
+ *
+ * As with power_refcount, power_refcount of a core only leaves zero under
+ * core_power_lock.
+ */
+int rknpu_core_power_get(struct rknpu_device *rknpu_dev, u32 core_mask)
+{
+	struct rknpu_subcore_data *subcore_data;
+	ktime_t start;
+	u32 got = 0;
+	int i, ret = 0;
+
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (!(core_mask & BIT(i)) || !subcore_data->power_dev)
+			continue;
+
+		if (atomic_inc_not_zero(&subcore_data->power_refcount)) {
+			got |= BIT(i);
+			continue;
+		}
+
+		mutex_lock(&rknpu_dev->core_power_lock);
+		if (!subcore_data->power_on) {
+			start = ktime_get();
+			ret = pm_runtime_resume_and_get(subcore_data->power_dev);
+			if (ret < 0) {
+				mutex_unlock(&rknpu_dev->core_power_lock);
+				LOG_DEV_ERROR(rknpu_dev->dev,
+					      "failed pm_runtime npu%d: %d\n", i,
+					      ret);
+				rknpu_core_power_put(rknpu_dev, got);
+				return ret;
+			}
+			subcore_data->power_on = true;
+			subcore_data->power_ons++;
+			/* The core's MMU lost its state with the domain */
+			rknpu_iommu_restore(rknpu_dev, BIT(i));
+			rknpu_lat_hist_add(&rknpu_dev->core_on_hist, start);
+		}
+		atomic_inc(&subcore_data->power_refcount);
+		mutex_unlock(&rknpu_dev->core_power_lock);
+		got |= BIT(i);
+	}
+
+	return 0;
+}
+
+void rknpu_core_power_put(struct rknpu_device *rknpu_dev, u32 core_mask)
+{
+	struct rknpu_subcore_data *subcore_data;
+	int i;
+
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (!(core_mask & BIT(i)) || !subcore_data->power_dev)
+			continue;
+
+		if (atomic_dec_and_test(&subcore_data->power_refcount))
+			mod_delayed_work(rknpu_dev->power_off_wq,
+					 &subcore_data->power_off_work,
+					 msecs_to_jiffies(core_idle_ms));
+	}
+}
+
+/* Must be called with core_power_lock held */
+static void rknpu_core_power_off(struct rknpu_subcore_data *subcore_data)
+{
+	if (!subcore_data->power_on ||
+	    atomic_read(&subcore_data->power_refcount))
+		return;
+
+	pm_runtime_put_sync(subcore_data->power_dev);
+	subcore_data->power_on = false;
+}
+
+static void rknpu_core_power_off_work(struct work_struct *work)
+{
+	struct rknpu_subcore_data *subcore_data =
+		container_of(to_delayed_work(work), struct rknpu_subcore_data,
+			     power_off_work);
+	struct rknpu_device *rknpu_dev = subcore_data->rknpu_dev;
+
+	mutex_lock(&rknpu_dev->core_power_lock);
+	rknpu_core_power_off(subcore_data);
+	mutex_unlock(&rknpu_dev->core_power_lock);
+}
+
+/* Cores whose registers can be accessed while the NPU is on */
+u32 rknpu_core_power_mask(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_subcore_data *subcore_data;
+	u32 core_mask = 0;
+	int i;
+
+	mutex_lock(&rknpu_dev->core_power_lock);
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (!subcore_data->power_dev || subcore_data->power_on)
+			core_mask |= BIT(i);
+	}
+	mutex_unlock(&rknpu_dev->core_power_lock);
+
+	return core_mask;
+}
+
 static int rknpu_action(struct rknpu_device *rknpu_dev,
 			struct rknpu_action *args)
 {
@@ -191,8 +381,11 @@ static int rknpu_action(struct rknpu_device *rknpu_dev,
 		ret = 0;
 		break;
 	case RKNPU_GET_TOTAL_SRAM_SIZE:
+		args->value = rknpu_sram_total_size(rknpu_dev);
+		ret = 0;
+		break;
 	case RKNPU_GET_FREE_SRAM_SIZE:
-		args->value = 0;
+		args->value = rknpu_sram_free_size(rknpu_dev);
 		ret = 0;
 		break;
 	case RKNPU_GET_IOMMU_DOMAIN_ID:
@@ -203,9 +396,14 @@ static int rknpu_action(struct rknpu_device *rknpu_dev,
 		/* Single domain only — accept but ignore */
 		ret = 0;
 		break;
+	case RKNPU_ACT_FLUSH_FREE:
+		rknpu_mem_flush_free(rknpu_dev);
+		ret = 0;
+		break;
 	case RKNPU_POWER_ON:
-		atomic_inc(&rknpu_dev->cmdline_power_refcount);
 		ret = rknpu_power_get(rknpu_dev);
+		if (!ret)
+			atomic_inc(&rknpu_dev->cmdline_power_refcount);
 		break;
 	case RKNPU_POWER_OFF:
 		if (atomic_dec_if_positive(&rknpu_dev->cmdline_power_refcount) >= 0)
@@ -237,6 +435,16 @@ static int rknpu_open(struct inode *inode, struct file *file)
 
 	session->rknpu_dev = rknpu_dev;
 	INIT_LIST_HEAD(&session->list);
+	INIT_LIST_HEAD(&session->import_cache);
+	mutex_init(&session->mm_lock);
+	xa_init_flags(&session->handles, XA_FLAGS_ALLOC);
+	mt_init_flags(&session->mmap_offsets, MT_FLAGS_ALLOC_RANGE);
+	session->pid = get_task_pid(current, PIDTYPE_TGID);
+	get_task_comm(session->comm, current->group_leader);
+
+	spin_lock(&rknpu_dev->lock);
+	list_add_tail(&session->head, &rknpu_dev->sessions);
+	spin_unlock(&rknpu_dev->lock);
 
 	file->private_data = (void *)session;
 
@@ -252,6 +460,8 @@ static int rknpu_release(struct inode *inode, struct file *file)
 
 	spin_lock(&rknpu_dev->lock);
 	list_replace_init(&session->list, &local_list);
+	list_splice_init(&session->import_cache, &local_list);
+	list_del(&session->head);
 	file->private_data = NULL;
 	spin_unlock(&rknpu_dev->lock);
 
@@ -259,147 +469,117 @@ static int rknpu_release(struct inode *inode, struct file *file)
 	list_for_each_entry_safe(entry, tmp, &local_list, head) {
 		LOG_DEBUG("fd close: free leaked obj dma_addr=%#llx size=%lu owner=%d\n",
 			  (__u64)entry->dma_addr, entry->size, entry->owner);
-		if (entry->owner) {
-			/* Path B: dma_alloc_coherent */
-			dma_free_coherent(rknpu_dev->dev, entry->size,
-					  entry->kv_addr, entry->dma_addr);
-		} else {
-			/* Path A: imported DMA-BUF */
-			if (entry->kv_addr && entry->dmabuf) {
-				struct iosys_map unmap =
-					IOSYS_MAP_INIT_VADDR(entry->kv_addr);
-				dma_buf_vunmap(entry->dmabuf, &unmap);
-			}
-			if (entry->sgt && entry->attachment)
-				dma_buf_unmap_attachment(entry->attachment,
-							entry->sgt,
-							DMA_BIDIRECTIONAL);
-			if (entry->attachment && entry->dmabuf)
-				dma_buf_detach(entry->dmabuf,
-					       entry->attachment);
-			if (entry->dmabuf)
-				dma_buf_put(entry->dmabuf);
-		}
 		list_del(&entry->head);
-		kfree(entry);
+		rknpu_mem_obj_put(entry);
 	}
 
+	xa_destroy(&session->handles);
+	mtree_destroy(&session->mmap_offsets);
+	put_pid(session->pid);
 	kfree(session);
 	return 0;
 }
 
+/* Legacy userspace mmaps with the BO's dma_addr as offset */
+static struct rknpu_mem_object *
+rknpu_mmap_lookup_dma_addr(struct rknpu_session *session, dma_addr_t addr,
+			   unsigned long size)
+{
+	struct rknpu_device *rknpu_dev = session->rknpu_dev;
+	struct rknpu_mem_object *entry;
+
+	spin_lock(&rknpu_dev->lock);
+	list_for_each_entry(entry, &session->list, head) {
+		if (entry->dma_addr == addr && size <= entry->size &&
+		    !entry->parent) {
+			rknpu_mem_obj_get(entry);
+			spin_unlock(&rknpu_dev->lock);
+			return entry;
+		}
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	return NULL;
+}
+
 static int rknpu_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct rknpu_session *session = file->private_data;
-	struct rknpu_device *rknpu_dev;
 	struct rknpu_mem_object *entry;
 	unsigned long size = vma->vm_end - vma->vm_start;
-	unsigned long pfn = vma->vm_pgoff;
-	dma_addr_t target_addr = (dma_addr_t)pfn << PAGE_SHIFT;
-	bool found = false;
+	unsigned long pgoff = vma->vm_pgoff;
 	int ret;
 
-	LOG_INFO("mmap: pgoff=0x%lx size=%lu target_addr=0x%llx\n",
-		 pfn, size, (u64)target_addr);
+	LOG_DEBUG("mmap: pgoff=%#lx size=%lu\n", pgoff, size);
 
 	if (!session) {
 		LOG_ERROR("mmap: no session\n");
 		return -EINVAL;
 	}
 
-	rknpu_dev = session->rknpu_dev;
+	/*
+	 * Fake offset from MEM_MAP plus any page offset inside the BO; the
+	 * mapping may cover any page range of it. vm_pgoff becomes the
+	 * offset in the BO.
+	 */
+	entry = rknpu_mem_obj_lookup_pgoff(session, pgoff);
+	if (entry && pgoff - entry->mmap_pgoff + vma_pages(vma) >
+			     PAGE_ALIGN(entry->size) >> PAGE_SHIFT) {
+		rknpu_mem_obj_put(entry);
+		entry = NULL;
+	}
 
-	/* Find the BO matching this DMA address */
-	spin_lock(&rknpu_dev->lock);
-	list_for_each_entry(entry, &session->list, head) {
-		LOG_INFO("mmap: checking BO dma_addr=0x%llx size=%lu\n",
-			 (u64)entry->dma_addr, entry->size);
-		if (entry->dma_addr == target_addr && size <= entry->size) {
-			found = true;
-			break;
-		}
+	if (entry) {
+		vma->vm_pgoff = pgoff - entry->mmap_pgoff;
+	} else if (pgoff < RKNPU_MEM_MMAP_PGOFF_MIN) {
+		/* Legacy offsets always map from the start of the BO */
+		entry = rknpu_mmap_lookup_dma_addr(
+			session, (dma_addr_t)pgoff << PAGE_SHIFT, size);
+		vma->vm_pgoff = 0;
 	}
-	spin_unlock(&rknpu_dev->lock);
 
-	if (!found) {
-		LOG_ERROR("mmap: no BO found for dma_addr %#llx size=%lu\n",
-			  (u64)target_addr, size);
+	if (!entry) {
+		LOG_ERROR("mmap: no BO at offset %#llx size=%lu\n",
+			  (u64)pgoff << PAGE_SHIFT, size);
 		return -EINVAL;
 	}
 
-	/*
-	 * dma_alloc_coherent memory can be mapped to userspace via
-	 * dma_mmap_coherent which handles the pfn translation correctly
-	 * for both IOMMU and non-IOMMU cases.
-	 *
-	 * CRITICAL: Reset vm_pgoff to 0 before calling dma_mmap_coherent.
-	 * We used vm_pgoff to look up the BO by dma_addr above, but
-	 * dma_common_mmap() interprets vm_pgoff as an offset INTO the
-	 * buffer. With the dma_addr as pgoff, it fails with -ENXIO
-	 * because pgoff > buffer page count.
-	 */
-	vma->vm_pgoff = 0;
+	ret = rknpu_mem_mmap_obj(session->rknpu_dev, entry, vma);
+	rknpu_mem_obj_put(entry);
 
-	ret = dma_mmap_coherent(rknpu_dev->dev, vma, entry->kv_addr,
-				entry->dma_addr, entry->size);
-	LOG_INFO("mmap: dma_mmap_coherent ret=%d\n", ret);
 	return ret;
 }
 
 static int rknpu_mem_map_ioctl(struct rknpu_device *rknpu_dev,
 			       struct file *file, unsigned long data)
 {
-	struct rknpu_mem_map args;
+	struct rknpu_session *session = file->private_data;
 	struct rknpu_mem_object *entry;
-	struct rknpu_session *session;
-	bool found = false;
+	struct rknpu_mem_map args;
 
 	if (unlikely(copy_from_user(&args, (struct rknpu_mem_map __user *)data,
 				    sizeof(args))))
 		return -EFAULT;
 
-	/*
-	 * The SDK passes the handle from MEM_CREATE.  Walk our session list
-	 * to find the matching BO and return dma_addr as the mmap offset.
-	 * Since we don't track by handle, match by the handle value stored
-	 * nowhere — instead just accept any recent allocation.
-	 *
-	 * Actually the SDK uses obj_addr (kptr) for most operations.  For
-	 * MEM_MAP the SDK passes the GEM handle.  We stored handle in
-	 * rknpu_mem_object during create, so look it up.
-	 *
-	 * Simpler approach: the SDK calls mmap with the dma_addr it already
-	 * received from MEM_CREATE.  Just return dma_addr = the BO's dma_addr
-	 * as the offset.  We need to find the BO by handle.
-	 *
-	 * Since we don't store handle in the mem_object, use a simple
-	 * approach: return the dma_addr of the most recent allocation that
-	 * matches the handle ordinal.  Actually, we need to store the handle.
-	 *
-	 * For now, just find any BO in the session and return its dma_addr.
-	 * The SDK calls MEM_MAP immediately after MEM_CREATE, so the last
-	 * entry in the list is the right one.
-	 */
-	session = file->private_data;
 	if (!session)
 		return -EFAULT;
 
-	spin_lock(&rknpu_dev->lock);
-	if (!list_empty(&session->list)) {
-		/* Return the last (most recently added) entry's dma_addr */
-		entry = list_last_entry(&session->list,
-					struct rknpu_mem_object, head);
-		args.offset = (__u64)entry->dma_addr;
-		found = true;
-	}
-	spin_unlock(&rknpu_dev->lock);
-
-	if (!found) {
+	/*
+	 * The handle from MEM_CREATE (the fd for imports) selects the BO;
+	 * its fake offset is unique within the session, so any number of
+	 * threads may create and map BOs concurrently.
+	 */
+	entry = rknpu_mem_obj_lookup_handle(session, args.handle);
+	if (!entry) {
 		LOG_ERROR("mem_map: no BO found for handle %u\n", args.handle);
 		return -EINVAL;
 	}
 
-	LOG_INFO("mem_map: handle=%u offset=0x%llx\n", args.handle, args.offset);
+	args.offset = (__u64)entry->mmap_pgoff << PAGE_SHIFT;
+	rknpu_mem_obj_put(entry);
+
+	LOG_DEBUG("mem_map: handle=%u offset=%#llx\n", args.handle,
+		  args.offset);
 
 	if (unlikely(copy_to_user((struct rknpu_mem_map __user *)data,
 				  &args, sizeof(args))))
@@ -412,6 +592,7 @@ static long rknpu_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	long ret = -EINVAL;
 	struct rknpu_device *rknpu_dev = NULL;
+	bool need_power;
 
 	if (!file->private_data)
 		return -EINVAL;
@@ -421,7 +602,20 @@ static long rknpu_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	LOG_INFO("ioctl: cmd=0x%x nr=%d dir=%d size=%d\n",
 		 cmd, _IOC_NR(cmd), _IOC_DIR(cmd), _IOC_SIZE(cmd));
 
-	rknpu_power_get(rknpu_dev);
+	/* Memory ioctls never touch the NPU, it may stay off for them */
+	need_power = _IOC_NR(cmd) == RKNPU_ACTION ||
+		     _IOC_NR(cmd) == RKNPU_SUBMIT;
+	if (_IOC_NR(cmd) == RKNPU_SUBMIT) {
+		rknpu_power_note_submit(rknpu_dev);
+		atomic64_inc(&rknpu_dev->submits);
+		if (!atomic_read(&rknpu_dev->power_refcount))
+			atomic64_inc(&rknpu_dev->cold_submits);
+	}
+	if (need_power) {
+		ret = rknpu_power_get(rknpu_dev);
+		if (ret)
+			return ret;
+	}
 
 	switch (_IOC_NR(cmd)) {
 	case RKNPU_ACTION: {
@@ -452,23 +646,72 @@ static long rknpu_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		ret = rknpu_mem_destroy_ioctl(rknpu_dev, file, arg);
 		break;
 	case RKNPU_MEM_SYNC:
-		ret = rknpu_mem_sync_ioctl(rknpu_dev, arg);
+		ret = rknpu_mem_sync_ioctl(rknpu_dev, file, arg);
+		break;
+	case RKNPU_MEM_EXPORT:
+		ret = rknpu_mem_export_ioctl(rknpu_dev, file, arg);
+		break;
+	case RKNPU_MEM_SHARE:
+		ret = rknpu_mem_share_ioctl(rknpu_dev, file, arg);
+		break;
+	case RKNPU_MEM_VIEW:
+		ret = rknpu_mem_view_ioctl(rknpu_dev, file, arg);
 		break;
 	default:
 		LOG_WARN("ioctl: UNKNOWN nr=%d cmd=0x%x\n", _IOC_NR(cmd), cmd);
 		break;
 	}
 
-	rknpu_power_put_delay(rknpu_dev);
+	if (need_power)
+		rknpu_power_put_delay(rknpu_dev);
 
 	return ret;
 }
 
+/*
+ * Give mappings of PMD size or more an address that is PMD-aligned
+ * relative to the start of the BO, so the 2 MB chunks of page-array BOs
+ * can be mapped with block entries.
+ */
+static unsigned long rknpu_get_unmapped_area(struct file *file,
+					     unsigned long addr,
+					     unsigned long len,
+					     unsigned long pgoff,
+					     unsigned long flags)
+{
+	struct rknpu_session *session = file->private_data;
+	struct rknpu_mem_object *entry;
+	unsigned long ret, off = 0;
+
+	if (!IS_ENABLED(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) || len < PMD_SIZE ||
+	    addr || (flags & MAP_FIXED))
+		return mm_get_unmapped_area(current->mm, file, addr, len,
+					    pgoff, flags);
+
+	if (session) {
+		entry = rknpu_mem_obj_lookup_pgoff(session, pgoff);
+		if (entry) {
+			off = ((pgoff - entry->mmap_pgoff) << PAGE_SHIFT) &
+			      ~PMD_MASK;
+			rknpu_mem_obj_put(entry);
+		}
+	}
+
+	ret = mm_get_unmapped_area(current->mm, file, 0, len + PMD_SIZE,
+				   pgoff, flags);
+	if (IS_ERR_VALUE(ret))
+		return mm_get_unmapped_area(current->mm, file, addr, len,
+					    pgoff, flags);
+
+	return round_up(ret - off, PMD_SIZE) + off;
+}
+
 static const struct file_operations rknpu_fops = {
 	.owner = THIS_MODULE,
 	.open = rknpu_open,
 	.release = rknpu_release,
 	.mmap = rknpu_mmap,
+	.get_unmapped_area = rknpu_get_unmapped_area,
 	.unlocked_ioctl = rknpu_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl = rknpu_ioctl,
@@ -480,7 +723,11 @@ static const struct file_operations rknpu_fops = {
 static int rknpu_power_on(struct rknpu_device *rknpu_dev)
 {
 	struct device *dev = rknpu_dev->dev;
-	int ret;
+	struct rknpu_subcore_data *subcore_data;
+	ktime_t start = ktime_get(), t;
+	u32 reattach_cores = 0;
+	s64 ns;
+	int i, ret;
 
 	LOG_DEV_INFO(dev, "power_on: multiple_domains=%d, genpd0=%p, genpd1=%p, genpd2=%p\n",
 		     rknpu_dev->multiple_domains,
@@ -493,10 +740,12 @@ static int rknpu_power_on(struct rknpu_device *rknpu_dev)
 		LOG_DEV_ERROR(dev, "failed to enable clks: %d\n", ret);
 		return ret;
 	}
+	rknpu_lat_hist_add(&rknpu_dev->clk_on_hist, start);
 	LOG_DEV_INFO(dev, "power_on: clks enabled (%d clks)\n",
 		     rknpu_dev->num_clks);
 
 	if (rknpu_dev->multiple_domains) {
+		t = ktime_get();
 		if (rknpu_dev->genpd_dev_npu0) {
 			ret = pm_runtime_resume_and_get(
 				rknpu_dev->genpd_dev_npu0);
@@ -506,98 +755,120 @@ static int rknpu_power_on(struct rknpu_device *rknpu_dev)
 				LOG_DEV_ERROR(dev,
 					      "failed pm_runtime npu0: %d\n",
 					      ret);
-				goto out;
-			}
-		}
-		if (rknpu_dev->genpd_dev_npu1) {
-			ret = pm_runtime_resume_and_get(
-				rknpu_dev->genpd_dev_npu1);
-			LOG_DEV_INFO(dev, "power_on: npu1 pm_runtime ret=%d\n",
-				     ret);
-			if (ret < 0) {
-				LOG_DEV_ERROR(dev,
-					      "failed pm_runtime npu1: %d\n",
-					      ret);
-				goto out;
+				goto err_clks;
 			}
 		}
-		if (rknpu_dev->genpd_dev_npu2) {
-			ret = pm_runtime_resume_and_get(
-				rknpu_dev->genpd_dev_npu2);
-			LOG_DEV_INFO(dev, "power_on: npu2 pm_runtime ret=%d\n",
-				     ret);
-			if (ret < 0) {
-				LOG_DEV_ERROR(dev,
-					      "failed pm_runtime npu2: %d\n",
-					      ret);
-				goto out;
+
+		/*
+		 * The other cores are powered per job by
+		 * rknpu_core_power_get(). Until the MMU state has been saved
+		 * the domain is re-attached to every MMU, so bring them all
+		 * up; rknpu_power_off() takes them down again.
+		 */
+		if (!rknpu_iommu_saved(rknpu_dev)) {
+			mutex_lock(&rknpu_dev->core_power_lock);
+			for (i = 1; i < rknpu_dev->config->num_irqs; i++) {
+				subcore_data = &rknpu_dev->subcore_datas[i];
+				if (!subcore_data->power_dev ||
+				    subcore_data->power_on)
+					continue;
+
+				ret = pm_runtime_resume_and_get(
+					subcore_data->power_dev);
+				if (ret < 0) {
+					LOG_DEV_ERROR(dev,
+						      "failed pm_runtime npu%d: %d\n",
+						      i, ret);
+					break;
+				}
+				subcore_data->power_on = true;
+				subcore_data->power_ons++;
+				reattach_cores |= BIT(i);
 			}
+			mutex_unlock(&rknpu_dev->core_power_lock);
+			if (ret < 0)
+				goto err_domains;
 		}
+		rknpu_lat_hist_add(&rknpu_dev->genpd_on_hist, t);
 	}
 
-	ret = pm_runtime_get_sync(dev);
+	/*
+	 * rknpu_runtime_resume() brings the MMUs back. The device can still
+	 * be active here, across a system sleep, which is not an error.
+	 */
+	ret = pm_runtime_resume_and_get(dev);
 	LOG_DEV_INFO(dev, "power_on: main pm_runtime ret=%d, status=%d\n",
 		     ret, dev->power.runtime_status);
 	if (ret < 0) {
 		LOG_DEV_ERROR(dev, "failed pm_runtime for rknpu: %d\n", ret);
-		goto out;
+		goto err_domains;
 	}
 
-	/* Re-initialize IOMMU after power-on.
-	 * The NPU's IOMMU registers (DTE at +0x9000, +0xa000) lose state
-	 * when the NPU power domain is turned off. Detach+reattach forces
-	 * rk_iommu_enable() to reprogram the DTE register.
-	 *
-	 * NOTE: This destroys existing BO IOMMU mappings if power cycles
-	 * between mem_create and submit. Use POWER_ON ioctl to hold power
-	 * and prevent this from firing between ioctls.
+	/*
+	 * Keep what the re-attach programmed, so that the cores brought up
+	 * for it are not needed again and drop after core_idle_ms unless a
+	 * job takes them.
 	 */
-	if (rknpu_dev->iommu_en && rknpu_dev->base[0]) {
-		struct iommu_domain *domain;
-		void __iomem *mmu0 = rknpu_dev->base[0] + 0x9000;
-		void __iomem *mmu1 = rknpu_dev->base[0] + 0xa000;
-		u32 dte0, dte1;
-
-		domain = iommu_get_domain_for_dev(dev);
-		if (domain) {
-			iommu_detach_device(domain, dev);
-			ret = iommu_attach_device(domain, dev);
-			if (ret) {
-				LOG_DEV_ERROR(dev,
-					      "failed iommu re-attach: %d\n",
-					      ret);
-			}
+	if (reattach_cores) {
+		rknpu_iommu_save(rknpu_dev, rknpu_core_power_mask(rknpu_dev));
+		for (i = 1; i < rknpu_dev->config->num_irqs; i++) {
+			if (reattach_cores & BIT(i))
+				mod_delayed_work(
+					rknpu_dev->power_off_wq,
+					&rknpu_dev->subcore_datas[i].power_off_work,
+					msecs_to_jiffies(core_idle_ms));
+		}
+	}
 
-			/* Force DTE valid bit.
-			 * iommu_attach_device() programs the page table base
-			 * but may not set bit 0 (valid). Without it, the IOMMU
-			 * ignores the page table and all DMA faults.
-			 */
-			wmb(); /* ensure IOMMU register writes complete */
-			dte0 = readl(mmu0 + 0x00);
-			dte1 = readl(mmu1 + 0x00);
-			LOG_DEV_INFO(dev,
-				     "power_on: DTE_CHECK mmu0=0x%x mmu1=0x%x\n",
-				     dte0, dte1);
-			if (dte0 && !(dte0 & 1)) {
-				writel(dte0 | 1, mmu0 + 0x00);
-				writel(dte1 | 1, mmu1 + 0x00);
-				wmb();
-				LOG_DEV_INFO(dev,
-					     "power_on: DTE_FORCED mmu0=0x%x mmu1=0x%x\n",
-					     readl(mmu0 + 0x00),
-					     readl(mmu1 + 0x00));
-			}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	rknpu_dev->power_on_count++;
+	rknpu_dev->power_on_ns += ns;
+	rknpu_dev->power_on_ns_max = max_t(u64, rknpu_dev->power_on_ns_max,
+					   ns);
+	rknpu_lat_hist_add(&rknpu_dev->power_on_hist, start);
+
+	return 0;
+
+	/* Undo it all, so that the next rknpu_power_get() can try again */
+err_domains:
+	if (reattach_cores) {
+		mutex_lock(&rknpu_dev->core_power_lock);
+		for (i = 1; i < rknpu_dev->config->num_irqs; i++) {
+			subcore_data = &rknpu_dev->subcore_datas[i];
+			if (!(reattach_cores & BIT(i)))
+				continue;
+
+			pm_runtime_put_sync(subcore_data->power_dev);
+			subcore_data->power_on = false;
 		}
+		mutex_unlock(&rknpu_dev->core_power_lock);
 	}
+	if (rknpu_dev->multiple_domains && rknpu_dev->genpd_dev_npu0)
+		pm_runtime_put_sync(rknpu_dev->genpd_dev_npu0);
+err_clks:
+	clk_bulk_disable_unprepare(rknpu_dev->num_clks, rknpu_dev->clks);
 
-out:
 	return ret;
 }
 
 static int rknpu_power_off(struct rknpu_device *rknpu_dev)
 {
 	struct device *dev = rknpu_dev->dev;
+	struct rknpu_subcore_data *subcore_data;
+	ktime_t start = ktime_get();
+	int i;
+
+	/* Idle cores go first, their MMU state is not needed any more */
+	for (i = 1; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (!subcore_data->power_dev)
+			continue;
+
+		cancel_delayed_work_sync(&subcore_data->power_off_work);
+		mutex_lock(&rknpu_dev->core_power_lock);
+		rknpu_core_power_off(subcore_data);
+		mutex_unlock(&rknpu_dev->core_power_lock);
+	}
 
 	pm_runtime_put_sync(dev);
 
@@ -611,16 +882,14 @@ static int rknpu_power_off(struct rknpu_device *rknpu_dev)
 		if (rknpu_dev->iommu_en)
 			msleep(20);
 
-		if (rknpu_dev->genpd_dev_npu2)
-			pm_runtime_put_sync(rknpu_dev->genpd_dev_npu2);
-		if (rknpu_dev->genpd_dev_npu1)
-			pm_runtime_put_sync(rknpu_dev->genpd_dev_npu1);
 		if (rknpu_dev->genpd_dev_npu0)
 			pm_runtime_put_sync(rknpu_dev->genpd_dev_npu0);
 	}
 
 	clk_bulk_disable_unprepare(rknpu_dev->num_clks, rknpu_dev->clks);
 
+	rknpu_lat_hist_add(&rknpu_dev->power_off_hist, start);
+
 	return 0;
 }
 
@@ -766,6 +1035,13 @@ static int rknpu_debugfs_regs_show(struct seq_file *s, void *unused)
 		return 0;
 	}
 
+	ret = rknpu_core_power_get(rknpu_dev, rknpu_dev->config->core_mask);
+	if (ret) {
+		seq_printf(s, "ERROR: failed to power on NPU cores: %d\n", ret);
+		rknpu_power_put_delay(rknpu_dev);
+		return 0;
+	}
+
 	/* Small delay for clocks to stabilize */
 	udelay(100);
 
@@ -800,6 +1076,7 @@ static int rknpu_debugfs_regs_show(struct seq_file *s, void *unused)
 		}
 	}
 
+	rknpu_core_power_put(rknpu_dev, rknpu_dev->config->core_mask);
 	rknpu_power_put_delay(rknpu_dev);
 	return 0;
 }
@@ -835,6 +1112,13 @@ static int rknpu_debugfs_regs_full_show(struct seq_file *s, void *unused)
 		return 0;
 	}
 
+	ret = rknpu_core_power_get(rknpu_dev, rknpu_dev->config->core_mask);
+	if (ret) {
+		seq_printf(s, "ERROR: failed to power on NPU cores: %d\n", ret);
+		rknpu_power_put_delay(rknpu_dev);
+		return 0;
+	}
+
 	udelay(100);
 
 	seq_printf(s, "# RKNPU Full Register Dump (%d cores)\n\n", num_cores);
@@ -861,6 +1145,7 @@ static int rknpu_debugfs_regs_full_show(struct seq_file *s, void *unused)
 		}
 	}
 
+	rknpu_core_power_put(rknpu_dev, rknpu_dev->config->core_mask);
 	rknpu_power_put_delay(rknpu_dev);
 	return 0;
 }
@@ -878,6 +1163,250 @@ static const struct file_operations rknpu_debugfs_regs_full_fops = {
 	.release = single_release,
 };
 
+static int rknpu_debugfs_mem_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_mem_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_mem_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_mem_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_mem_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_mem_pool_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_mem_pool_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_mem_pool_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_mem_shared_open(struct inode *inode,
+					 struct file *file)
+{
+	return single_open(file, rknpu_mem_shared_debugfs_show,
+			   inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_mem_shared_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_mem_shared_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_sram_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_sram_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_sram_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_sram_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_carveout_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_carveout_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_carveout_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_carveout_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_mem_evict_open(struct inode *inode,
+					struct file *file)
+{
+	return single_open(file, rknpu_mem_evict_debugfs_show,
+			   inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_mem_evict_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_mem_evict_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_iommu_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_iommu_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_iommu_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_iommu_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_sessions_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_mem_sessions_debugfs_show,
+			   inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_sessions_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_sessions_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_power_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct rknpu_subcore_data *subcore_data;
+	int i;
+
+	if (!rknpu_dev)
+		return -ENODEV;
+
+	seq_printf(s, "power_put_delay_ms: %lu (%s)\n",
+		   READ_ONCE(rknpu_dev->power_put_delay),
+		   rknpu_dev->power_put_delay_auto ? "auto" : "fixed");
+	seq_printf(s, "submit_gap_avg_us: %llu\n", rknpu_dev->submit_gap_us);
+
+	mutex_lock(&rknpu_dev->power_lock);
+	seq_printf(s, "power_refcount: %d\n",
+		   atomic_read(&rknpu_dev->power_refcount));
+	seq_printf(s, "power_ons: %llu\n", rknpu_dev->power_on_count);
+	seq_printf(s, "power_on_avg_us: %llu\n",
+		   rknpu_dev->power_on_count ?
+			   div64_u64(rknpu_dev->power_on_ns,
+				     rknpu_dev->power_on_count *
+					     NSEC_PER_USEC) : 0);
+	seq_printf(s, "power_on_max_us: %llu\n",
+		   rknpu_dev->power_on_ns_max / NSEC_PER_USEC);
+	seq_printf(s, "last_resume_us: %lld\n",
+		   rknpu_dev->resume_ns / NSEC_PER_USEC);
+	mutex_unlock(&rknpu_dev->power_lock);
+
+	mutex_lock(&rknpu_dev->core_power_lock);
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (!subcore_data->power_dev)
+			continue;
+		seq_printf(s, "core%d: on=%d jobs=%d power_ons=%llu\n", i,
+			   subcore_data->power_on,
+			   atomic_read(&subcore_data->power_refcount),
+			   subcore_data->power_ons);
+	}
+	mutex_unlock(&rknpu_dev->core_power_lock);
+
+	return 0;
+}
+
+static int rknpu_debugfs_power_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_debugfs_power_show, inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_power_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_power_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void rknpu_lat_hist_show(struct seq_file *s, const char *name,
+				const struct rknpu_lat_hist *hist)
+{
+	u64 total = 0;
+	int i;
+
+	for (i = 0; i < RKNPU_LAT_HIST_BUCKETS; i++)
+		total += hist->count[i];
+	seq_printf(s, "%s_us: %llu\n", name, total);
+
+	for (i = 0; i < RKNPU_LAT_HIST_BUCKETS; i++) {
+		if (!hist->count[i])
+			continue;
+		if (i == RKNPU_LAT_HIST_BUCKETS - 1)
+			seq_printf(s, "  %8llu -          : %llu\n",
+				   1ULL << (i - 1), hist->count[i]);
+		else
+			seq_printf(s, "  %8llu - %8llu: %llu\n",
+				   i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1,
+				   hist->count[i]);
+	}
+}
+
+static int rknpu_debugfs_power_hist_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+
+	if (!rknpu_dev)
+		return -ENODEV;
+
+	seq_printf(s, "submits: %lld\n", atomic64_read(&rknpu_dev->submits));
+	seq_printf(s, "cold_submits: %lld\n",
+		   atomic64_read(&rknpu_dev->cold_submits));
+
+	mutex_lock(&rknpu_dev->power_lock);
+	seq_printf(s, "delayed_power_offs: %llu\n",
+		   rknpu_dev->power_off_delayed);
+	rknpu_lat_hist_show(s, "clk_on", &rknpu_dev->clk_on_hist);
+	rknpu_lat_hist_show(s, "genpd_on", &rknpu_dev->genpd_on_hist);
+	rknpu_lat_hist_show(s, "iommu_restore", &rknpu_dev->iommu_hist);
+	rknpu_lat_hist_show(s, "power_on", &rknpu_dev->power_on_hist);
+	rknpu_lat_hist_show(s, "power_off", &rknpu_dev->power_off_hist);
+	mutex_unlock(&rknpu_dev->power_lock);
+
+	mutex_lock(&rknpu_dev->core_power_lock);
+	rknpu_lat_hist_show(s, "core_on", &rknpu_dev->core_on_hist);
+	mutex_unlock(&rknpu_dev->core_power_lock);
+
+	return 0;
+}
+
+static int rknpu_debugfs_power_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_debugfs_power_hist_show,
+			   inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_power_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_power_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int rknpu_debugfs_reset_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rknpu_reset_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations rknpu_debugfs_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = rknpu_debugfs_reset_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static void rknpu_debugfs_init(struct rknpu_device *rknpu_dev)
 {
 	rknpu_dev->debugfs_dir = debugfs_create_dir("rknpu", NULL);
@@ -888,6 +1417,31 @@ static void rknpu_debugfs_init(struct rknpu_device *rknpu_dev)
 			    rknpu_dev, &rknpu_debugfs_regs_fops);
 	debugfs_create_file("regs_full", 0444, rknpu_dev->debugfs_dir,
 			    rknpu_dev, &rknpu_debugfs_regs_full_fops);
+	debugfs_create_file("mem", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_mem_fops);
+	debugfs_create_file("mem_pool", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_mem_pool_fops);
+	debugfs_create_file("mem_shared", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_mem_shared_fops);
+	debugfs_create_file("sram", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_sram_fops);
+	debugfs_create_file("carveout", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_carveout_fops);
+	debugfs_create_file("mem_evict", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_mem_evict_fops);
+	debugfs_create_file("iommu", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_iommu_fops);
+	debugfs_create_file("power", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_power_fops);
+	debugfs_create_file("power_hist", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_power_hist_fops);
+	debugfs_create_file("reset", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_reset_fops);
+	/* Mask of cores whose next completion is dropped */
+	debugfs_create_ulong("inject_hang", 0644, rknpu_dev->debugfs_dir,
+			     &rknpu_dev->inject_hang);
+	debugfs_create_file("sessions", 0444, rknpu_dev->debugfs_dir,
+			    rknpu_dev, &rknpu_debugfs_sessions_fops);
 }
 
 static void rknpu_debugfs_fini(struct rknpu_device *rknpu_dev)
@@ -895,6 +1449,101 @@ static void rknpu_debugfs_fini(struct rknpu_device *rknpu_dev)
 	debugfs_remove_recursive(rknpu_dev->debugfs_dir);
 }
 
+/* --- sysfs --- */
+
+/* Writing a delay fixes it, power_put_delay_auto=1 goes back to learning */
+static ssize_t power_put_delay_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(rknpu_dev->power_put_delay));
+}
+
+static ssize_t power_put_delay_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+	unsigned long delay;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &delay);
+	if (ret)
+		return ret;
+
+	spin_lock(&rknpu_dev->lock);
+	rknpu_dev->power_put_delay_auto = false;
+	WRITE_ONCE(rknpu_dev->power_put_delay, delay);
+	spin_unlock(&rknpu_dev->lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(power_put_delay);
+
+static ssize_t power_put_delay_auto_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", rknpu_dev->power_put_delay_auto);
+}
+
+static ssize_t power_put_delay_auto_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	spin_lock(&rknpu_dev->lock);
+	rknpu_dev->power_put_delay_auto = enable;
+	spin_unlock(&rknpu_dev->lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(power_put_delay_auto);
+
+static ssize_t power_on_count_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%llu\n", rknpu_dev->power_on_count);
+}
+static DEVICE_ATTR_RO(power_on_count);
+
+static ssize_t power_on_avg_us_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+	u64 avg = 0;
+
+	mutex_lock(&rknpu_dev->power_lock);
+	if (rknpu_dev->power_on_count)
+		avg = div64_u64(rknpu_dev->power_on_ns,
+				rknpu_dev->power_on_count * NSEC_PER_USEC);
+	mutex_unlock(&rknpu_dev->power_lock);
+
+	return sysfs_emit(buf, "%llu\n", avg);
+}
+static DEVICE_ATTR_RO(power_on_avg_us);
+
+static struct attribute *rknpu_attrs[] = {
+	&dev_attr_power_put_delay.attr,
+	&dev_attr_power_put_delay_auto.attr,
+	&dev_attr_power_on_count.attr,
+	&dev_attr_power_on_avg_us.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(rknpu);
+
 /* --- platform driver --- */
 
 static int rknpu_probe(struct platform_device *pdev)
@@ -930,6 +1579,13 @@ static int rknpu_probe(struct platform_device *pdev)
 		return ret;
 	}
 
+	/*
+	 * Page-array BOs need their scatterlist merged into one IOVA range;
+	 * iommu-dma splits it at the default 64 KB segment size otherwise.
+	 */
+	dma_set_max_seg_size(dev, UINT_MAX);
+	dma_set_seg_boundary(dev, ULONG_MAX);
+
 	rknpu_dev->iommu_en = rknpu_is_iommu_enable(dev);
 	rknpu_dev->bypass_irq_handler = bypass_irq_handler;
 	rknpu_dev->bypass_soft_reset = bypass_soft_reset;
@@ -944,7 +1600,13 @@ static int rknpu_probe(struct platform_device *pdev)
 
 	spin_lock_init(&rknpu_dev->lock);
 	spin_lock_init(&rknpu_dev->irq_lock);
+	INIT_LIST_HEAD(&rknpu_dev->sessions);
+	mutex_init(&rknpu_dev->shared_lock);
+	init_llist_head(&rknpu_dev->free_list);
+	INIT_WORK(&rknpu_dev->free_work, rknpu_mem_free_work);
+	INIT_LIST_HEAD(&rknpu_dev->shared_bos);
 	mutex_init(&rknpu_dev->power_lock);
+	mutex_init(&rknpu_dev->core_power_lock);
 	mutex_init(&rknpu_dev->reset_lock);
 
 	/* Map MMIO regions for each core */
@@ -952,6 +1614,9 @@ static int rknpu_probe(struct platform_device *pdev)
 		INIT_LIST_HEAD(&rknpu_dev->subcore_datas[i].todo_list);
 		init_waitqueue_head(&rknpu_dev->subcore_datas[i].job_done_wq);
 		rknpu_dev->subcore_datas[i].task_num = 0;
+		rknpu_dev->subcore_datas[i].rknpu_dev = rknpu_dev;
+		INIT_DELAYED_WORK(&rknpu_dev->subcore_datas[i].power_off_work,
+				  rknpu_core_power_off_work);
 
 		res = platform_get_resource(pdev, IORESOURCE_MEM, i);
 		if (!res) {
@@ -980,6 +1645,40 @@ static int rknpu_probe(struct platform_device *pdev)
 		LOG_DEV_WARN(dev, "bypass irq handler!\n");
 	}
 
+	ret = rknpu_mem_pool_init(rknpu_dev);
+	if (ret)
+		return ret;
+
+	ret = rknpu_sram_init(rknpu_dev);
+	if (ret) {
+		rknpu_mem_pool_fini(rknpu_dev);
+		return ret;
+	}
+
+	ret = rknpu_carveout_init(rknpu_dev);
+	if (ret) {
+		rknpu_sram_fini(rknpu_dev);
+		rknpu_mem_pool_fini(rknpu_dev);
+		return ret;
+	}
+
+	ret = rknpu_mem_evict_init(rknpu_dev);
+	if (ret) {
+		rknpu_carveout_fini(rknpu_dev);
+		rknpu_sram_fini(rknpu_dev);
+		rknpu_mem_pool_fini(rknpu_dev);
+		return ret;
+	}
+
+	ret = rknpu_iommu_init(rknpu_dev);
+	if (ret) {
+		rknpu_mem_evict_fini(rknpu_dev);
+		rknpu_carveout_fini(rknpu_dev);
+		rknpu_sram_fini(rknpu_dev);
+		rknpu_mem_pool_fini(rknpu_dev);
+		return ret;
+	}
+
 	/* Register misc device */
 	rknpu_dev->miscdev.minor = MISC_DYNAMIC_MINOR;
 	rknpu_dev->miscdev.name = "rknpu";
@@ -988,6 +1687,11 @@ static int rknpu_probe(struct platform_device *pdev)
 	ret = misc_register(&rknpu_dev->miscdev);
 	if (ret) {
 		LOG_DEV_ERROR(dev, "cannot register miscdev (%d)\n", ret);
+		rknpu_iommu_fini(rknpu_dev);
+		rknpu_mem_evict_fini(rknpu_dev);
+		rknpu_carveout_fini(rknpu_dev);
+		rknpu_sram_fini(rknpu_dev);
+		rknpu_mem_pool_fini(rknpu_dev);
 		return ret;
 	}
 
@@ -1009,6 +1713,8 @@ static int rknpu_probe(struct platform_device *pdev)
 			if (!IS_ERR(virt_dev))
 				rknpu_dev->genpd_dev_npu2 = virt_dev;
 		}
+		rknpu_dev->subcore_datas[1].power_dev = rknpu_dev->genpd_dev_npu1;
+		rknpu_dev->subcore_datas[2].power_dev = rknpu_dev->genpd_dev_npu2;
 		rknpu_dev->multiple_domains = true;
 	}
 
@@ -1019,8 +1725,9 @@ static int rknpu_probe(struct platform_device *pdev)
 		goto err_remove;
 	}
 
-	/* Set default power put delay to 3s */
-	rknpu_dev->power_put_delay = 3000;
+	/* Start from the longest delay until submits have been seen */
+	rknpu_dev->power_put_delay = RKNPU_POWER_DELAY_MAX_MS;
+	rknpu_dev->power_put_delay_auto = true;
 	rknpu_dev->power_off_wq =
 		create_freezable_workqueue("rknpu_power_off_wq");
 	if (!rknpu_dev->power_off_wq) {
@@ -1046,6 +1753,12 @@ static int rknpu_probe(struct platform_device *pdev)
 
 err_remove:
 	misc_deregister(&rknpu_dev->miscdev);
+	pm_runtime_disable(dev);
+	rknpu_iommu_fini(rknpu_dev);
+	rknpu_mem_evict_fini(rknpu_dev);
+	rknpu_carveout_fini(rknpu_dev);
+	rknpu_sram_fini(rknpu_dev);
+	rknpu_mem_pool_fini(rknpu_dev);
 	return ret;
 }
 
@@ -1055,6 +1768,9 @@ static void rknpu_remove(struct platform_device *pdev)
 	int i;
 
 	cancel_delayed_work_sync(&rknpu_dev->power_off_work);
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++)
+		cancel_delayed_work_sync(
+			&rknpu_dev->subcore_datas[i].power_off_work);
 	destroy_workqueue(rknpu_dev->power_off_wq);
 
 	rknpu_cancel_timer(rknpu_dev);
@@ -1066,6 +1782,11 @@ static void rknpu_remove(struct platform_device *pdev)
 
 	rknpu_debugfs_fini(rknpu_dev);
 	misc_deregister(&rknpu_dev->miscdev);
+	rknpu_mem_flush_free(rknpu_dev);
+	rknpu_mem_evict_fini(rknpu_dev);
+	rknpu_carveout_fini(rknpu_dev);
+	rknpu_sram_fini(rknpu_dev);
+	rknpu_mem_pool_fini(rknpu_dev);
 
 	mutex_lock(&rknpu_dev->power_lock);
 	if (atomic_read(&rknpu_dev->power_refcount) > 0)
@@ -1082,8 +1803,156 @@ static void rknpu_remove(struct platform_device *pdev)
 	}
 
 	pm_runtime_disable(&pdev->dev);
+	rknpu_iommu_fini(rknpu_dev);
 }
 
+/*
+ * Queued jobs survive a system sleep: intake stops, the running jobs
+ * finish and the rest stay queued. The NPU, and every core domain still
+ * held by queued jobs, is powered off with the MMU state saved, and comes
+ * back the same way on resume before the queue is restarted. If the NPU
+ * cannot be powered back on, the queued jobs fail instead, the references
+ * held on it are dropped and the next submit tries again.
+ */
+static int rknpu_suspend(struct device *dev)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+	struct rknpu_subcore_data *subcore_data;
+	int i, ret;
+
+	ret = rknpu_job_suspend(rknpu_dev);
+	if (ret)
+		return ret;
+
+	/* A pending delayed power off is re-armed on resume */
+	rknpu_dev->suspend_power_off_pending =
+		cancel_delayed_work_sync(&rknpu_dev->power_off_work);
+
+	/*
+	 * The PM core holds a runtime PM reference across system sleep, so
+	 * the puts below never reach rknpu_runtime_suspend(). Save the MMU
+	 * state here, while the NPU and its cores are still up.
+	 */
+	mutex_lock(&rknpu_dev->power_lock);
+	if (atomic_read(&rknpu_dev->power_refcount) > 0)
+		rknpu_iommu_save(rknpu_dev, rknpu_core_power_mask(rknpu_dev));
+	mutex_unlock(&rknpu_dev->power_lock);
+
+	for (i = 1; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (!subcore_data->power_dev)
+			continue;
+
+		cancel_delayed_work_sync(&subcore_data->power_off_work);
+		mutex_lock(&rknpu_dev->core_power_lock);
+		if (subcore_data->power_on) {
+			pm_runtime_put_sync(subcore_data->power_dev);
+			subcore_data->power_on = false;
+		}
+		mutex_unlock(&rknpu_dev->core_power_lock);
+	}
+
+	mutex_lock(&rknpu_dev->power_lock);
+	rknpu_dev->suspend_powered =
+		atomic_read(&rknpu_dev->power_refcount) > 0;
+	if (rknpu_dev->suspend_powered)
+		rknpu_power_off(rknpu_dev);
+	mutex_unlock(&rknpu_dev->power_lock);
+
+	return 0;
+}
+
+static int rknpu_resume(struct device *dev)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+	struct rknpu_subcore_data *subcore_data;
+	ktime_t start = ktime_get();
+	int i, ret;
+
+	mutex_lock(&rknpu_dev->power_lock);
+	if (rknpu_dev->suspend_powered) {
+		ret = rknpu_power_on(rknpu_dev);
+		if (ret) {
+			LOG_DEV_ERROR(dev, "failed to power on after resume: %d\n",
+				      ret);
+			/*
+			 * The NPU is off: the queued jobs fail, and the
+			 * references taken before the suspend, theirs
+			 * included, go so the NPU does not count as on.
+			 */
+			rknpu_job_fail_queued(rknpu_dev, ret);
+			atomic_set(&rknpu_dev->cmdline_power_refcount, 0);
+			atomic_set(&rknpu_dev->power_refcount, 0);
+			rknpu_dev->suspend_powered = false;
+			mutex_unlock(&rknpu_dev->power_lock);
+			/* Nothing is left queued, new jobs power the NPU up */
+			rknpu_job_resume(rknpu_dev);
+			return ret;
+		}
+		/* Nor does rknpu_runtime_resume() run here */
+		rknpu_iommu_restore(rknpu_dev, rknpu_core_power_mask(rknpu_dev));
+	}
+	mutex_unlock(&rknpu_dev->power_lock);
+
+	/* Cores with queued jobs */
+	mutex_lock(&rknpu_dev->core_power_lock);
+	for (i = 1; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (!subcore_data->power_dev || subcore_data->power_on ||
+		    !atomic_read(&subcore_data->power_refcount))
+			continue;
+
+		ret = pm_runtime_resume_and_get(subcore_data->power_dev);
+		if (ret < 0) {
+			LOG_DEV_ERROR(dev, "failed pm_runtime npu%d: %d\n", i,
+				      ret);
+			continue;
+		}
+		subcore_data->power_on = true;
+		subcore_data->power_ons++;
+		rknpu_iommu_restore(rknpu_dev, BIT(i));
+	}
+	mutex_unlock(&rknpu_dev->core_power_lock);
+
+	if (rknpu_dev->suspend_power_off_pending)
+		queue_delayed_work(
+			rknpu_dev->power_off_wq, &rknpu_dev->power_off_work,
+			msecs_to_jiffies(READ_ONCE(rknpu_dev->power_put_delay)));
+
+	rknpu_job_resume(rknpu_dev);
+
+	rknpu_dev->resume_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	return 0;
+}
+
+static int rknpu_runtime_suspend(struct device *dev)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+
+	rknpu_iommu_save(rknpu_dev, rknpu_core_power_mask(rknpu_dev));
+
+	return 0;
+}
+
+static int rknpu_runtime_resume(struct device *dev)
+{
+	struct rknpu_device *rknpu_dev = dev_get_drvdata(dev);
+
+	ktime_t start = ktime_get();
+
+	/* A failed MMU shows up as faults on the next job, keep going */
+	rknpu_iommu_restore(rknpu_dev, rknpu_core_power_mask(rknpu_dev));
+	rknpu_lat_hist_add(&rknpu_dev->iommu_hist, start);
+
+	return 0;
+}
+
+static const struct dev_pm_ops rknpu_pm_ops = {
+	SYSTEM_SLEEP_PM_OPS(rknpu_suspend, rknpu_resume)
+	RUNTIME_PM_OPS(rknpu_runtime_suspend, rknpu_runtime_resume, NULL)
+};
+
 static struct platform_driver rknpu_driver = {
 	.probe = rknpu_probe,
 	.remove = rknpu_remove,
@@ -1091,6 +1960,8 @@ static struct platform_driver rknpu_driver = {
 		.owner = THIS_MODULE,
 		.name = "RKNPU",
 		.of_match_table = of_match_ptr(rknpu_of_match),
+		.pm = pm_ptr(&rknpu_pm_ops),
+		.dev_groups = rknpu_groups,
 	},
 };
 
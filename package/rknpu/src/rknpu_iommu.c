@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Save and restore of the NPU's MMU state across power cycles.
+ *
+ * The MMUs in front of the NPU cores sit in the NPU power domain and come
+ * back from a power cycle with paging disabled and no page directory.
+ * Re-attaching the IOMMU domain on every power-up reprograms them but is
+ * slow. All sessions share one domain, so the page directory address
+ * never changes: the runtime-suspend callback saves it and runtime resume
+ * writes it back, zaps the stale IOTLB and re-enables paging. Mappings
+ * made while the NPU was off live in the page tables in memory and are
+ * untouched.
+ *
+ * Until a state has been saved (the very first power-up) the domain is
+ * re-attached as before. Re-attaching programs every instance, so the
+ * caller must have all cores powered then.
+ *
+ * Cores other than core 0 can be powered down on their own; only the
+ * instances in the cores given by @core_mask are touched.
+ */
+
+#include <linux/iommu.h>
+#include <linux/io.h>
+#include <linux/iopoll.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "rknpu_drv.h"
+#include "rknpu_iommu.h"
+
+int rknpu_iommu_init(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_iommu *iommu;
+	int i;
+
+	if (!rknpu_dev->iommu_en || !rknpu_dev->base[0])
+		return 0;
+
+	iommu = kzalloc(sizeof(*iommu), GFP_KERNEL);
+	if (!iommu)
+		return -ENOMEM;
+
+	iommu->base[iommu->num_mmu++] = rknpu_dev->base[0] + RKNPU_MMU0_OFFSET;
+	iommu->base[iommu->num_mmu++] = rknpu_dev->base[0] + RKNPU_MMU_OFFSET;
+	for (i = 1; i < rknpu_dev->config->num_irqs &&
+		    iommu->num_mmu < RKNPU_MMU_MAX; i++) {
+		if (!rknpu_dev->base[i])
+			continue;
+		iommu->core[iommu->num_mmu] = i;
+		iommu->base[iommu->num_mmu++] =
+			rknpu_dev->base[i] + RKNPU_MMU_OFFSET;
+	}
+
+	rknpu_dev->iommu = iommu;
+
+	return 0;
+}
+
+void rknpu_iommu_fini(struct rknpu_device *rknpu_dev)
+{
+	kfree(rknpu_dev->iommu);
+	rknpu_dev->iommu = NULL;
+}
+
+/* Record the page directory from an MMU of @core_mask with paging enabled */
+void rknpu_iommu_save(struct rknpu_device *rknpu_dev, u32 core_mask)
+{
+	struct rknpu_iommu *iommu = rknpu_dev->iommu;
+	unsigned int i;
+
+	if (!iommu)
+		return;
+
+	for (i = 0; i < iommu->num_mmu; i++) {
+		void __iomem *mmu = iommu->base[i];
+		u32 dte;
+
+		if (!(core_mask & BIT(iommu->core[i])))
+			continue;
+
+		dte = readl(mmu + RKNPU_MMU_DTE_ADDR);
+		if (dte && readl(mmu + RKNPU_MMU_STATUS) &
+			   RKNPU_MMU_STATUS_PAGING_ENABLED) {
+			iommu->dte = dte;
+			return;
+		}
+	}
+}
+
+bool rknpu_iommu_saved(struct rknpu_device *rknpu_dev)
+{
+	return !rknpu_dev->iommu || rknpu_dev->iommu->dte;
+}
+
+static int rknpu_iommu_reattach(struct rknpu_device *rknpu_dev)
+{
+	struct device *dev = rknpu_dev->dev;
+	struct iommu_domain *domain;
+	int ret;
+
+	domain = iommu_get_domain_for_dev(dev);
+	if (!domain)
+		return 0;
+
+	iommu_detach_device(domain, dev);
+	ret = iommu_attach_device(domain, dev);
+	if (ret)
+		LOG_DEV_ERROR(dev, "failed iommu re-attach: %d\n", ret);
+
+	return ret;
+}
+
+/*
+ * iommu_attach_device() programs the page table base but may not set
+ * bit 0 (valid). Without it, the IOMMU ignores the page table and all
+ * DMA faults.
+ */
+static void rknpu_iommu_force_valid(struct rknpu_iommu *iommu)
+{
+	unsigned int i;
+	u32 dte;
+
+	wmb(); /* ensure IOMMU register writes complete */
+	for (i = 0; i < iommu->num_mmu; i++) {
+		dte = readl(iommu->base[i] + RKNPU_MMU_DTE_ADDR);
+		if (dte && !(dte & 1))
+			writel(dte | 1, iommu->base[i] + RKNPU_MMU_DTE_ADDR);
+	}
+	wmb();
+}
+
+/*
+ * Bring the MMUs of @core_mask back after a power-up. Called with the NPU
+ * clocked and those cores powered, before any job runs on them.
+ */
+int rknpu_iommu_restore(struct rknpu_device *rknpu_dev, u32 core_mask)
+{
+	struct rknpu_iommu *iommu = rknpu_dev->iommu;
+	bool restored = false;
+	unsigned int i;
+	u32 status;
+	int ret = 0;
+
+	if (!iommu)
+		return 0;
+
+	if (!iommu->dte) {
+		iommu->reattaches++;
+		ret = rknpu_iommu_reattach(rknpu_dev);
+		rknpu_iommu_force_valid(iommu);
+		return ret;
+	}
+
+	for (i = 0; i < iommu->num_mmu; i++) {
+		void __iomem *mmu = iommu->base[i];
+
+		if (!(core_mask & BIT(iommu->core[i])))
+			continue;
+
+		if (readl(mmu + RKNPU_MMU_DTE_ADDR) == iommu->dte &&
+		    readl(mmu + RKNPU_MMU_STATUS) &
+			    RKNPU_MMU_STATUS_PAGING_ENABLED)
+			continue;
+
+		/* Page tables may have changed while the NPU was off */
+		writel(iommu->dte, mmu + RKNPU_MMU_DTE_ADDR);
+		writel(RKNPU_MMU_CMD_ZAP_CACHE, mmu + RKNPU_MMU_COMMAND);
+		writel(RKNPU_MMU_IRQ_MASK, mmu + RKNPU_MMU_INT_MASK);
+		writel(RKNPU_MMU_CMD_ENABLE_PAGING, mmu + RKNPU_MMU_COMMAND);
+
+		if (readl_poll_timeout(mmu + RKNPU_MMU_STATUS, status,
+				       status & RKNPU_MMU_STATUS_PAGING_ENABLED,
+				       1, 100)) {
+			LOG_DEV_ERROR(rknpu_dev->dev,
+				      "mmu%u: paging not enabled, status %#x\n",
+				      i, status);
+			iommu->failures++;
+			ret = -ETIMEDOUT;
+		}
+		restored = true;
+	}
+
+	if (restored)
+		iommu->restores++;
+	else
+		iommu->retained++;
+
+	return ret;
+}
+
+int rknpu_iommu_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct rknpu_iommu *iommu;
+
+	if (!rknpu_dev || !rknpu_dev->iommu) {
+		seq_puts(s, "no iommu\n");
+		return 0;
+	}
+
+	iommu = rknpu_dev->iommu;
+
+	mutex_lock(&rknpu_dev->power_lock);
+	seq_printf(s, "mmus: %u\n", iommu->num_mmu);
+	seq_printf(s, "saved_dte: %#x\n", iommu->dte);
+	seq_printf(s, "retained: %llu\n", iommu->retained);
+	seq_printf(s, "restores: %llu\n", iommu->restores);
+	seq_printf(s, "reattaches: %llu\n", iommu->reattaches);
+	seq_printf(s, "failures: %llu\n", iommu->failures);
+	mutex_unlock(&rknpu_dev->power_lock);
+
+	return 0;
+}
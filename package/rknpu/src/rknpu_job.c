@@ -12,12 +12,14 @@
 #include <linux/dma-mapping.h>
 #include <linux/iommu.h>
 #include <linux/io.h>
+#include <linux/module.h>
 #include <linux/uaccess.h>
 
 #include "rknpu_ioctl.h"
 #include "rknpu_drv.h"
 #include "rknpu_reset.h"
 #include "rknpu_mem.h"
+#include "rknpu_mem_evict.h"
 #include "rknpu_job.h"
 
 #define _REG_READ(base, offset) readl(base + (offset))
@@ -26,6 +28,14 @@
 #define REG_READ(offset) _REG_READ(rknpu_core_base, offset)
 #define REG_WRITE(value, offset) _REG_WRITE(rknpu_core_base, value, offset)
 
+static bool dump_regcmd;
+module_param(dump_regcmd, bool, 0644);
+MODULE_PARM_DESC(dump_regcmd,
+		 "log the first regcmds of every submit, disabled by default");
+
+/* Longest a system suspend waits for the running jobs */
+#define RKNPU_SUSPEND_DRAIN_MS 2000
+
 static int rknpu_wait_core_index(int core_mask)
 {
 	int index = 0;
@@ -94,6 +104,10 @@ static int rknpu_get_task_number(struct rknpu_job *job, int core_index)
 
 static void rknpu_job_free(struct rknpu_job *job)
 {
+	rknpu_core_power_put(job->rknpu_dev, job->power_mask);
+	if (job->power_held)
+		rknpu_power_put_delay(job->rknpu_dev);
+	rknpu_mem_resident_put(job->resident);
 	if (job->args_owner)
 		kfree(job->args);
 	kfree(job);
@@ -313,6 +327,10 @@ static inline int rknpu_job_wait(struct rknpu_job *job)
 	if (!(job->flags & RKNPU_JOB_DONE))
 		return -EINVAL;
 
+	/* Failed without running, see rknpu_job_fail_queued() */
+	if (job->ret)
+		return job->ret;
+
 	args->task_counter = args->task_number;
 	args->hw_elapse_time = job->hw_elapse_time;
 
@@ -340,7 +358,7 @@ static inline int rknpu_job_subcore_commit_pc(struct rknpu_job *job,
 	int submit_index = atomic_read(&job->submit_count[core_index]);
 	int max_submit_number = rknpu_dev->config->max_submit_number;
 
-	if (!task_obj) {
+	if (!task_obj || !task_obj->kv_addr) {
 		job->ret = -EINVAL;
 		return job->ret;
 	}
@@ -534,7 +552,8 @@ static void rknpu_job_next(struct rknpu_device *rknpu_dev, int core_index)
 
 	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
 
-	if (subcore_data->job || list_empty(&subcore_data->todo_list)) {
+	if (rknpu_dev->suspended || subcore_data->resetting ||
+	    subcore_data->job || list_empty(&subcore_data->todo_list)) {
 		spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
 		return;
 	}
@@ -577,11 +596,17 @@ static void rknpu_job_done(struct rknpu_job *job, int ret, int core_index)
 	subcore_data->timer.busy_time += ktime_sub(now, job->hw_recoder_time);
 	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
 
+	/* rknpu_job_suspend() waits for the core, not the job */
+	if (rknpu_dev->suspended)
+		wake_up(&subcore_data->job_done_wq);
+
 	if (atomic_dec_and_test(&job->interrupt_count)) {
 		int use_core_num = job->use_core_num;
 
 		job->flags |= RKNPU_JOB_DONE;
-		job->ret = ret;
+		/* Keep the error of a core failed by rknpu_job_fail_core() */
+		if (!job->ret)
+			job->ret = ret;
 
 		if (job->flags & RKNPU_JOB_ASYNC)
 			schedule_work(&job->cleanup_work);
@@ -595,6 +620,29 @@ static void rknpu_job_done(struct rknpu_job *job, int ret, int core_index)
 	rknpu_job_next(rknpu_dev, core_index);
 }
 
+/*
+ * Give up @job on one of its cores without it completing there, and
+ * complete it with @ret once no core is left. Called with irq_lock held,
+ * after the job was taken off that core.
+ */
+static void rknpu_job_fail_core(struct rknpu_job *job, int ret)
+{
+	struct rknpu_device *rknpu_dev = job->rknpu_dev;
+	int wait_index;
+
+	job->ret = ret;
+	if (!atomic_dec_and_test(&job->interrupt_count))
+		return;
+
+	wait_index = rknpu_wait_core_index(job->args->core_mask);
+	job->flags |= RKNPU_JOB_DONE;
+
+	if (job->flags & RKNPU_JOB_ASYNC)
+		schedule_work(&job->cleanup_work);
+
+	wake_up(&(&rknpu_dev->subcore_datas[wait_index])->job_done_wq);
+}
+
 static int rknpu_schedule_core_index(struct rknpu_device *rknpu_dev)
 {
 	int core_num = rknpu_dev->config->num_irqs;
@@ -612,20 +660,30 @@ static int rknpu_schedule_core_index(struct rknpu_device *rknpu_dev)
 	return core_index;
 }
 
+/*
+ * Resolve an AUTO core mask before the job is queued, so that the cores it
+ * runs on can be powered up first.
+ */
+static void rknpu_job_pick_core(struct rknpu_job *job)
+{
+	int core_index;
+
+	if (job->args->core_mask != RKNPU_CORE_AUTO_MASK)
+		return;
+
+	core_index = rknpu_schedule_core_index(job->rknpu_dev);
+	job->args->core_mask = rknpu_core_mask(core_index);
+	job->use_core_num = 1;
+	atomic_set(&job->run_count, job->use_core_num);
+	atomic_set(&job->interrupt_count, job->use_core_num);
+}
+
 static void rknpu_job_schedule(struct rknpu_job *job)
 {
 	struct rknpu_device *rknpu_dev = job->rknpu_dev;
 	struct rknpu_subcore_data *subcore_data = NULL;
-	int i = 0, core_index = 0;
 	unsigned long flags;
-
-	if (job->args->core_mask == RKNPU_CORE_AUTO_MASK) {
-		core_index = rknpu_schedule_core_index(rknpu_dev);
-		job->args->core_mask = rknpu_core_mask(core_index);
-		job->use_core_num = 1;
-		atomic_set(&job->run_count, job->use_core_num);
-		atomic_set(&job->interrupt_count, job->use_core_num);
-	}
+	int i = 0;
 
 	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
 	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
@@ -643,12 +701,43 @@ static void rknpu_job_schedule(struct rknpu_job *job)
 	}
 }
 
+/*
+ * Fail the jobs running on the cores in @core_mask, which a reset shared
+ * with another core has just stopped.
+ */
+static void rknpu_job_fail_running(struct rknpu_device *rknpu_dev,
+				   u32 core_mask, int ret)
+{
+	struct rknpu_subcore_data *subcore_data = NULL;
+	struct rknpu_job *job = NULL;
+	unsigned long flags;
+	int i = 0;
+
+	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
+		if (!(core_mask & rknpu_core_mask(i)))
+			continue;
+
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		job = subcore_data->job;
+		/* Completed before the reset, rknpu_job_done() has it */
+		if (!job || job->irq_entry[i])
+			continue;
+
+		subcore_data->job = NULL;
+		subcore_data->task_num -= rknpu_get_task_number(job, i);
+		rknpu_job_fail_core(job, ret);
+	}
+	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
+}
+
 static void rknpu_job_abort(struct rknpu_job *job)
 {
 	struct rknpu_device *rknpu_dev = job->rknpu_dev;
 	struct rknpu_subcore_data *subcore_data = NULL;
 	unsigned long flags;
-	int i = 0;
+	u32 reset_mask = 0;
+	int i = 0, ret;
 
 	msleep(100);
 
@@ -711,7 +800,27 @@ static void rknpu_job_abort(struct rknpu_job *job)
 			LOG_ERROR("\tIOMMU[0xa000]: DTE=0x%x STATUS=0x%x PG_FAULT=0x%x RAW=0x%x MASK=0x%x\n",
 				  dte1, sts1, pf1, raw1, msk1);
 		}
-		rknpu_soft_reset(rknpu_dev);
+		reset_mask = job->args->core_mask;
+		ret = rknpu_soft_reset_cores(rknpu_dev, &reset_mask);
+
+		/* A shared reset line also stopped the jobs on other cores */
+		rknpu_job_fail_running(rknpu_dev,
+				       reset_mask & ~job->args->core_mask, -EIO);
+
+		/*
+		 * Restart what queued up behind the reset cores. A core that
+		 * was not reset may still hang, its queue waits for the next
+		 * timeout to try again.
+		 */
+		if (ret || !reset_mask) {
+			LOG_ERROR("cores %#x not reset, not restarted\n",
+				  job->args->core_mask);
+		} else {
+			for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
+				if (reset_mask & rknpu_core_mask(i))
+					rknpu_job_next(rknpu_dev, i);
+			}
+		}
 	} else {
 		LOG_ERROR(
 			"job abort, flags: %#x, ret: %d, elapsed: %lldus\n",
@@ -772,6 +881,16 @@ static inline irqreturn_t rknpu_irq_handler(int irq, void *data, int core_index)
 		rknpu_job_next(rknpu_dev, core_index);
 		return IRQ_HANDLED;
 	}
+
+	/* Fault injection from debugfs: lose the completion, the core hangs */
+	if (test_and_clear_bit(core_index, &rknpu_dev->inject_hang)) {
+		spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
+		REG_WRITE(RKNPU_INT_CLEAR, RKNPU_OFFSET_INT_CLEAR);
+		LOG_WARN("irq: core=%d completion dropped, injected hang\n",
+			 core_index);
+		return IRQ_HANDLED;
+	}
+
 	job->irq_entry[core_index] = true;
 	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
 
@@ -811,27 +930,123 @@ irqreturn_t rknpu_core2_irq_handler(int irq, void *data)
 	return rknpu_irq_handler(irq, data, 2);
 }
 
+/*
+ * Stop committing jobs and wait for the running ones. Queued jobs stay in
+ * the todo lists, together with their power references, and run once
+ * rknpu_job_resume() is called.
+ */
+int rknpu_job_suspend(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_subcore_data *subcore_data;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
+	rknpu_dev->suspended = true;
+	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
+
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (!wait_event_timeout(subcore_data->job_done_wq,
+					!READ_ONCE(subcore_data->job),
+					msecs_to_jiffies(RKNPU_SUSPEND_DRAIN_MS))) {
+			LOG_ERROR("core %d still busy, aborting suspend\n", i);
+			rknpu_job_resume(rknpu_dev);
+			return -EBUSY;
+		}
+	}
+
+	return 0;
+}
+
+void rknpu_job_resume(struct rknpu_device *rknpu_dev)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
+	rknpu_dev->suspended = false;
+	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
+
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++)
+		rknpu_job_next(rknpu_dev, i);
+}
+
+/*
+ * Complete every queued job with @ret instead of running it, for when the
+ * NPU could not be brought back after a system sleep. The jobs' NPU
+ * references are dropped by the caller along with the others.
+ */
+void rknpu_job_fail_queued(struct rknpu_device *rknpu_dev, int ret)
+{
+	struct rknpu_subcore_data *subcore_data;
+	struct rknpu_job *job, *q;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
+	for (i = 0; i < rknpu_dev->config->num_irqs; i++) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		list_for_each_entry_safe(job, q, &subcore_data->todo_list,
+					 head[i]) {
+			list_del_init(&job->head[i]);
+			subcore_data->task_num -= rknpu_get_task_number(job, i);
+			job->power_held = false;
+			rknpu_job_fail_core(job, ret);
+		}
+	}
+	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
+}
+
+/* The job takes over @resident, also when it fails */
 static int rknpu_submit(struct rknpu_device *rknpu_dev,
-			struct rknpu_submit *args)
+			struct rknpu_submit *args,
+			struct rknpu_mem_resident *resident)
 {
 	struct rknpu_job *job = NULL;
 	int ret = -EINVAL;
 
 	if (args->task_number == 0) {
 		LOG_ERROR("invalid rknpu task number!\n");
+		rknpu_mem_resident_put(resident);
 		return -EINVAL;
 	}
 
 	if (args->core_mask > rknpu_dev->config->core_mask) {
 		LOG_ERROR("invalid rknpu core mask: %#x", args->core_mask);
+		rknpu_mem_resident_put(resident);
 		return -EINVAL;
 	}
 
 	job = rknpu_job_alloc(rknpu_dev, args);
 	if (!job) {
 		LOG_ERROR("failed to allocate rknpu job!\n");
+		rknpu_mem_resident_put(resident);
 		return -ENOMEM;
 	}
+	job->resident = resident;
+
+	/*
+	 * The SUBMIT ioctl drops its NPU reference when it returns, which can
+	 * be well before a NONBLOCK job ends: the job holds one of its own.
+	 */
+	ret = rknpu_power_get(rknpu_dev);
+	if (ret) {
+		LOG_ERROR("failed to power rknpu: %d\n", ret);
+		rknpu_job_free(job);
+		return ret;
+	}
+	job->power_held = true;
+
+	rknpu_job_pick_core(job);
+	ret = rknpu_core_power_get(rknpu_dev, job->args->core_mask);
+	if (ret) {
+		LOG_ERROR("failed to power rknpu cores %#x: %d\n",
+			  job->args->core_mask, ret);
+		rknpu_job_free(job);
+		return ret;
+	}
+	job->power_mask = job->args->core_mask;
 
 	if (args->flags & RKNPU_JOB_NONBLOCK) {
 		job->flags |= RKNPU_JOB_ASYNC;
@@ -877,6 +1092,7 @@ int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 		       unsigned int cmd, unsigned long data)
 {
 	struct rknpu_submit args;
+	struct rknpu_mem_resident *resident;
 	struct rknpu_mem_object *task_obj;
 	struct rknpu_session *session;
 	struct iommu_domain *domain = NULL;
@@ -915,11 +1131,53 @@ int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 		}
 	}
 
+	if (args.bo_reserved || args.bo_count > RKNPU_SUBMIT_MAX_BOS)
+		return -EINVAL;
+
+	/* Evicted weights come back before anything uses the session's BOs */
+	session = file->private_data;
+	if (session && args.bo_count) {
+		u32 *handles;
+
+		handles = memdup_array_user(u64_to_user_ptr(args.bo_handles),
+					    args.bo_count, sizeof(*handles));
+		if (IS_ERR(handles))
+			return PTR_ERR(handles);
+		resident = rknpu_mem_make_resident(session, handles,
+						   args.bo_count);
+		kfree(handles);
+	} else {
+		resident = session ?
+			rknpu_mem_make_resident(session, NULL, 0) : NULL;
+	}
+	if (IS_ERR(resident)) {
+		LOG_ERROR("submit: restoring evicted BOs failed: %ld\n",
+			  PTR_ERR(resident));
+		return PTR_ERR(resident);
+	}
+
+	/* The CPU reads task descriptors; imports are only mapped now */
+	if (args.task_obj_addr) {
+		task_obj = rknpu_mem_obj_lookup(rknpu_dev, file,
+						args.task_obj_addr);
+		if (!task_obj) {
+			LOG_ERROR("submit: invalid task_obj_addr %#llx\n",
+				  args.task_obj_addr);
+			rknpu_mem_resident_put(resident);
+			return -EINVAL;
+		}
+		ret = rknpu_mem_kmap(task_obj);
+		rknpu_mem_obj_put(task_obj);
+		if (ret) {
+			rknpu_mem_resident_put(resident);
+			return ret;
+		}
+	}
+
 	/*
 	 * Fill IOVA gaps between session BOs with guard pages.
 	 * Sort BOs by IOVA, find gaps, fill each gap page-by-page.
 	 */
-	session = file->private_data;
 	if (session && rknpu_dev->iommu_en) {
 		struct rknpu_mem_object *bo;
 		struct { dma_addr_t start; dma_addr_t end; } ranges[32];
@@ -1016,6 +1274,8 @@ int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 
 	/*
 	 * Flush CPU caches for ALL imported DMA-BUF BOs before NPU access.
+	 * Cacheable page-array BOs (RKNPU_MEM_NON_CONTIGUOUS) are flushed
+	 * as well; coherent and write-combined BOs need no maintenance.
 	 *
 	 * The SDK writes task descriptors, regcmds, and input data to
 	 * DMA-BUF mapped memory via CPU. On BSP 5.10, the driver's
@@ -1030,10 +1290,16 @@ int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 		int sync_count = 0;
 		int i;
 
-		/* Collect sgt pointers under lock, sync outside */
+		/*
+		 * Collect sgt pointers under lock, sync outside. Evicted BOs
+		 * the submit does not name stay out: their table points at
+		 * the scratch page.
+		 */
 		spin_lock(&rknpu_dev->lock);
 		list_for_each_entry(bo, &session->list, head) {
-			if (!bo->owner && bo->sgt && sync_count < 32)
+			if (bo->sgt && sync_count < 32 &&
+			    !READ_ONCE(bo->evicted) &&
+			    (!bo->owner || (bo->flags & RKNPU_MEM_CACHEABLE)))
 				sync_sgt[sync_count++] = bo->sgt;
 		}
 		spin_unlock(&rknpu_dev->lock);
@@ -1047,10 +1313,10 @@ int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 	}
 
 	/*
-	 * Dump first regcmds of task[0] to verify IOVA addresses.
+	 * Dump first regcmds of task[0] to verify IOVA addresses (dump_regcmd).
 	 * Find the BO containing regcmd_addr and dump from kv_addr.
 	 */
-	if (session && args.task_obj_addr) {
+	if (dump_regcmd && session && args.task_obj_addr) {
 		struct rknpu_mem_object *task_obj =
 			(struct rknpu_mem_object *)(uintptr_t)args.task_obj_addr;
 		if (task_obj && task_obj->kv_addr) {
@@ -1065,14 +1331,20 @@ int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			list_for_each_entry(bo, &session->list, head) {
 				dma_addr_t bo_end = bo->dma_addr + bo->size;
 				if (regcmd_iova >= bo->dma_addr &&
-				    regcmd_iova < bo_end && bo->kv_addr) {
+				    regcmd_iova < bo_end) {
 					u64 off = regcmd_iova - bo->dma_addr;
-					u32 *rcmd = (u32 *)((u8 *)bo->kv_addr + off);
+					u32 *rcmd;
 					int words = min_t(int, 280,
 						(bo->size - off) / 4);
 					int w;
 
+					rknpu_mem_obj_get(bo);
 					spin_unlock(&rknpu_dev->lock);
+					if (rknpu_mem_kmap(bo)) {
+						rknpu_mem_obj_put(bo);
+						goto regcmd_done;
+					}
+					rcmd = (u32 *)((u8 *)bo->kv_addr + off);
 					LOG_INFO("submit: regcmd in BO dma=0x%llx"
 						 " off=0x%llx entries=%d:\n",
 						 (u64)bo->dma_addr, off,
@@ -1098,6 +1370,7 @@ int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 							LOG_INFO("  [%03d] reg=0x%04x tgt=0x%04x val=0x%08x\n",
 								 w / 2, reg, tgt, val);
 					}
+					rknpu_mem_obj_put(bo);
 					goto regcmd_done;
 				}
 			}
@@ -1106,11 +1379,14 @@ int rknpu_submit_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 	}
 regcmd_done:
 
-	ret = rknpu_submit(rknpu_dev, &args);
+	ret = rknpu_submit(rknpu_dev, &args, resident);
 
 	/*
 	 * Sync DMA-BUF BOs from device after NPU completes.
 	 * This ensures CPU can read NPU output data from DMA-BUFs.
+	 * Evictable BOs (weights) are unpinned by now and may be evicted
+	 * under us; MEM_SYNC handles them. Shared BOs are mapped
+	 * DMA_TO_DEVICE, the NPU cannot write them.
 	 */
 	if (session) {
 		struct rknpu_mem_object *bo;
@@ -1120,7 +1396,9 @@ regcmd_done:
 
 		spin_lock(&rknpu_dev->lock);
 		list_for_each_entry(bo, &session->list, head) {
-			if (!bo->owner && bo->sgt && sync_count < 32)
+			if (bo->sgt && sync_count < 32 &&
+			    !(bo->flags & RKNPU_MEM_EVICTABLE) && !bo->shared &&
+			    (!bo->owner || (bo->flags & RKNPU_MEM_CACHEABLE)))
 				sync_sgt[sync_count++] = bo->sgt;
 		}
 		spin_unlock(&rknpu_dev->lock);
@@ -0,0 +1,588 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Residency management for RKNPU_MEM_EVICTABLE BOs (model weights).
+ *
+ * A device that keeps dozens of models loaded but runs a handful at a
+ * time holds all of their weights in DRAM. Evictable BOs are kept on an
+ * LRU list; when the resident ones exceed evict_budget_mb, idle BOs are
+ * written to a shmem file (which the kernel may swap out) and their pages
+ * are freed. The IOVA range stays allocated to the BO's original
+ * dma_map_sgtable() mapping and points at a zeroed scratch page meanwhile,
+ * so the NPU address userspace baked into its register commands stays
+ * valid and a stray access reads zeros instead of faulting.
+ *
+ * SUBMIT names the BOs its register commands use in a handle list; those
+ * that are evicted are brought back and pinned until the job is freed.
+ * Userspace that passes no list gets every evictable BO of the session
+ * instead. mmap and MEM_VIEW bring a BO back as well; a BO that is
+ * mapped, viewed or otherwise referenced beyond its session is never
+ * evicted. The budget is enforced when memory is brought in, never by
+ * waiting for pinned BOs.
+ *
+ * Only page-array BOs through the IOMMU can be evicted. Evicted BOs still
+ * count towards their session's footprint.
+ */
+
+#include <linux/dma-mapping.h>
+#include <linux/file.h>
+#include <linux/highmem.h>
+#include <linux/iommu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/overflow.h>
+#include <linux/seq_file.h>
+#include <linux/shmem_fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "rknpu_drv.h"
+#include "rknpu_ioctl.h"
+#include "rknpu_mem.h"
+#include "rknpu_mem_evict.h"
+
+static unsigned int evict_budget_mb;
+module_param(evict_budget_mb, uint, 0644);
+MODULE_PARM_DESC(evict_budget_mb,
+		 "keep at most this many MB of RKNPU_MEM_EVICTABLE BOs in memory, 0 (no limit) by default");
+
+int rknpu_mem_evict_init(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_mem_evict *evict;
+
+	/* The IOVA range of an evicted BO must outlive its pages */
+	if (!rknpu_dev->iommu_en)
+		return 0;
+
+	evict = kzalloc(sizeof(*evict), GFP_KERNEL);
+	if (!evict)
+		return -ENOMEM;
+
+	evict->scratch = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!evict->scratch) {
+		kfree(evict);
+		return -ENOMEM;
+	}
+
+	mutex_init(&evict->lock);
+	INIT_LIST_HEAD(&evict->lru);
+	rknpu_dev->mem_evict = evict;
+
+	return 0;
+}
+
+/* All evictable BOs must have been released */
+void rknpu_mem_evict_fini(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_mem_evict *evict = rknpu_dev->mem_evict;
+
+	if (!evict)
+		return;
+
+	rknpu_dev->mem_evict = NULL;
+
+	WARN_ON(!list_empty(&evict->lru));
+	__free_page(evict->scratch);
+	kfree(evict);
+}
+
+/*
+ * Point the CPU side of the BO's table at @pages, or at the scratch page
+ * if @pages is NULL. The table is the one dma_map_sgtable() mapped, one
+ * entry per page; its DMA side keeps describing the BO's IOVA range, so
+ * dma_sync_sgtable_*() maintain the caches of the pages currently behind
+ * the range and dma_unmap_sgtable() eventually releases it.
+ */
+static void rknpu_mem_evict_set_pages(struct rknpu_mem_object *rknpu_obj,
+				      struct page **pages)
+{
+	struct page *scratch = rknpu_obj->rknpu_dev->mem_evict->scratch;
+	struct scatterlist *sg;
+	unsigned int i;
+
+	for_each_sgtable_sg(rknpu_obj->sgt, sg, i)
+		sg_set_page(sg, pages ? pages[i] : scratch, PAGE_SIZE, 0);
+}
+
+/*
+ * Point the IOVA range of @rknpu_obj at @pages (the scratch page if NULL)
+ * instead of @old. The range itself stays allocated to the BO's DMA
+ * mapping; only its page table entries are replaced.
+ */
+static int rknpu_mem_evict_remap(struct rknpu_device *rknpu_dev,
+				 struct rknpu_mem_object *rknpu_obj,
+				 struct page **pages, struct page **old)
+{
+	struct iommu_domain *domain = iommu_get_domain_for_dev(rknpu_dev->dev);
+	int prot = IOMMU_READ | IOMMU_WRITE;
+	ssize_t mapped;
+
+	if (!domain)
+		return -ENODEV;
+
+	iommu_unmap(domain, rknpu_obj->dma_addr, rknpu_obj->size);
+
+	rknpu_mem_evict_set_pages(rknpu_obj, pages);
+	mapped = iommu_map_sgtable(domain, rknpu_obj->dma_addr,
+				   rknpu_obj->sgt, prot);
+	if (mapped == rknpu_obj->size)
+		return 0;
+
+	LOG_ERROR("evict: iommu_map of %lu bytes at %#llx failed: %zd\n",
+		  rknpu_obj->size, (u64)rknpu_obj->dma_addr, mapped);
+
+	/* Put the old pages back so the range stays whole */
+	rknpu_mem_evict_set_pages(rknpu_obj, old);
+	if (iommu_map_sgtable(domain, rknpu_obj->dma_addr, rknpu_obj->sgt,
+			      prot) != rknpu_obj->size)
+		LOG_ERROR("evict: IOVA range %#llx left unmapped\n",
+			  (u64)rknpu_obj->dma_addr);
+
+	return mapped < 0 ? mapped : -ENOMEM;
+}
+
+static void rknpu_mem_evict_free_pages(struct rknpu_mem_object *rknpu_obj)
+{
+	unsigned long i;
+
+	for (i = 0; i < rknpu_obj->num_pages; i++) {
+		if (rknpu_obj->pages[i])
+			__free_page(rknpu_obj->pages[i]);
+		rknpu_obj->pages[i] = NULL;
+	}
+	memset(rknpu_obj->nr_chunks, 0, sizeof(rknpu_obj->nr_chunks));
+}
+
+/* Write @rknpu_obj to shmem and free its pages. Called with the lock held */
+static int rknpu_mem_evict_obj(struct rknpu_device *rknpu_dev,
+			       struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_mem_evict *evict = rknpu_dev->mem_evict;
+	unsigned long i, num_pages = rknpu_obj->num_pages;
+	struct file *backup;
+	int ret;
+
+	backup = shmem_file_setup("rknpu-evict", rknpu_obj->size, VM_NORESERVE);
+	if (IS_ERR(backup))
+		return PTR_ERR(backup);
+
+	/* Copy through the cacheable linear map: clean, then invalidate */
+	dma_sync_sgtable_for_device(rknpu_dev->dev, rknpu_obj->sgt,
+				    DMA_TO_DEVICE);
+	dma_sync_sgtable_for_cpu(rknpu_dev->dev, rknpu_obj->sgt,
+				 DMA_FROM_DEVICE);
+
+	for (i = 0; i < num_pages; i++) {
+		struct folio *folio = shmem_read_folio(backup->f_mapping, i);
+
+		if (IS_ERR(folio)) {
+			ret = PTR_ERR(folio);
+			goto err_put_backup;
+		}
+		copy_highpage(folio_file_page(folio, i), rknpu_obj->pages[i]);
+		folio_mark_dirty(folio);
+		folio_put(folio);
+		cond_resched();
+	}
+
+	ret = rknpu_mem_evict_remap(rknpu_dev, rknpu_obj, NULL,
+				    rknpu_obj->pages);
+	if (ret)
+		goto err_put_backup;
+
+	vunmap(rknpu_obj->kv_addr);
+	rknpu_obj->kv_addr = NULL;
+	rknpu_mem_evict_free_pages(rknpu_obj);
+	rknpu_obj->backup = backup;
+	rknpu_obj->evicted = true;
+
+	evict->resident -= rknpu_obj->size;
+	evict->evicted += rknpu_obj->size;
+	evict->evictions++;
+
+	LOG_DEBUG("evict: obj=%p dma=%#llx size=%lu\n", rknpu_obj,
+		  (u64)rknpu_obj->dma_addr, rknpu_obj->size);
+
+	return 0;
+
+err_put_backup:
+	fput(backup);
+	return ret;
+}
+
+/*
+ * Evict idle BOs, least recently used first, until @need more bytes fit
+ * in the budget. Called with the lock held.
+ */
+static void rknpu_mem_evict_shrink(struct rknpu_device *rknpu_dev,
+				   size_t need)
+{
+	struct rknpu_mem_evict *evict = rknpu_dev->mem_evict;
+	size_t budget = (size_t)READ_ONCE(evict_budget_mb) << 20;
+	struct rknpu_mem_object *rknpu_obj;
+
+	list_for_each_entry(rknpu_obj, &evict->lru, evict_head) {
+		if (!budget || evict->resident + need <= budget)
+			break;
+		/* Only the session holds it: not mapped, viewed or in use */
+		if (rknpu_obj->evicted || rknpu_obj->pin_count ||
+		    kref_read(&rknpu_obj->refcount) != 1)
+			continue;
+		if (rknpu_mem_evict_obj(rknpu_dev, rknpu_obj))
+			evict->failures++;
+	}
+}
+
+/* Read an evicted BO back into new pages. Called with the lock held */
+static int rknpu_mem_evict_load(struct rknpu_device *rknpu_dev,
+				struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_mem_evict *evict = rknpu_dev->mem_evict;
+	unsigned long i, num_pages = rknpu_obj->num_pages;
+	ktime_t start = ktime_get();
+	void *kv_addr;
+	s64 ns;
+	int ret;
+
+	rknpu_mem_evict_shrink(rknpu_dev, rknpu_obj->size);
+
+	ret = rknpu_mem_fill_pages(rknpu_dev, rknpu_obj);
+	if (ret)
+		goto err_free_pages;
+
+	for (i = 0; i < num_pages; i++) {
+		struct folio *folio = shmem_read_folio(rknpu_obj->backup->f_mapping,
+						       i);
+
+		if (IS_ERR(folio)) {
+			ret = PTR_ERR(folio);
+			goto err_free_pages;
+		}
+		copy_highpage(rknpu_obj->pages[i], folio_file_page(folio, i));
+		folio_put(folio);
+		cond_resched();
+	}
+
+	kv_addr = rknpu_mem_vmap_pages(rknpu_obj);
+	if (!kv_addr) {
+		ret = -ENOMEM;
+		goto err_free_pages;
+	}
+
+	ret = rknpu_mem_evict_remap(rknpu_dev, rknpu_obj, rknpu_obj->pages,
+				    NULL);
+	if (ret)
+		goto err_vunmap;
+
+	/* The copy went through the linear map; write it back to memory */
+	dma_sync_sgtable_for_device(rknpu_dev->dev, rknpu_obj->sgt,
+				    DMA_TO_DEVICE);
+
+	rknpu_obj->kv_addr = kv_addr;
+	fput(rknpu_obj->backup);
+	rknpu_obj->backup = NULL;
+	rknpu_obj->evicted = false;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	evict->resident += rknpu_obj->size;
+	evict->evicted -= rknpu_obj->size;
+	evict->restores++;
+	evict->restore_ns += ns;
+	evict->restore_ns_max = max_t(u64, evict->restore_ns_max, ns);
+
+	LOG_DEBUG("evict: restored obj=%p dma=%#llx size=%lu in %lldus\n",
+		  rknpu_obj, (u64)rknpu_obj->dma_addr, rknpu_obj->size,
+		  ns / NSEC_PER_USEC);
+
+	return 0;
+
+err_vunmap:
+	vunmap(kv_addr);
+err_free_pages:
+	rknpu_mem_evict_free_pages(rknpu_obj);
+	evict->failures++;
+	return ret;
+}
+
+/* Start tracking a new, resident BO */
+void rknpu_mem_evict_add(struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+	struct rknpu_mem_evict *evict = rknpu_dev->mem_evict;
+
+	mutex_lock(&evict->lock);
+	rknpu_mem_evict_shrink(rknpu_dev, rknpu_obj->size);
+	list_add_tail(&rknpu_obj->evict_head, &evict->lru);
+	evict->resident += rknpu_obj->size;
+	mutex_unlock(&evict->lock);
+}
+
+/* Stop tracking a BO that is being freed and drop its shmem copy */
+void rknpu_mem_evict_del(struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_mem_evict *evict = rknpu_obj->rknpu_dev->mem_evict;
+
+	mutex_lock(&evict->lock);
+	list_del(&rknpu_obj->evict_head);
+	if (rknpu_obj->evicted) {
+		evict->evicted -= rknpu_obj->size;
+		fput(rknpu_obj->backup);
+		rknpu_obj->backup = NULL;
+	} else {
+		evict->resident -= rknpu_obj->size;
+	}
+	mutex_unlock(&evict->lock);
+}
+
+/*
+ * Bring @rknpu_obj back into memory if needed and mark it recently used.
+ * The caller must hold a reference besides the session's, which keeps the
+ * BO from being evicted again.
+ */
+int rknpu_mem_evict_restore(struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+	struct rknpu_mem_evict *evict = rknpu_dev->mem_evict;
+	int ret = 0;
+
+	mutex_lock(&evict->lock);
+	list_move_tail(&rknpu_obj->evict_head, &evict->lru);
+	if (rknpu_obj->evicted)
+		ret = rknpu_mem_evict_load(rknpu_dev, rknpu_obj);
+	mutex_unlock(&evict->lock);
+
+	return ret;
+}
+
+/* Drop the references of a @resident that was never pinned */
+static void rknpu_mem_resident_free(struct rknpu_mem_resident *resident)
+{
+	unsigned int i;
+
+	for (i = 0; i < resident->nr; i++)
+		rknpu_mem_obj_put(resident->objs[i]);
+	kfree(resident);
+}
+
+/* Pin the BOs in @resident and read back those that were evicted */
+static int rknpu_mem_resident_load(struct rknpu_mem_resident *resident)
+{
+	struct rknpu_device *rknpu_dev = resident->rknpu_dev;
+	struct rknpu_mem_evict *evict = rknpu_dev->mem_evict;
+	struct rknpu_mem_object *rknpu_obj;
+	unsigned int i;
+	int ret = 0;
+
+	mutex_lock(&evict->lock);
+	/* Pin them all first so making room never evicts one of them */
+	for (i = 0; i < resident->nr; i++) {
+		rknpu_obj = resident->objs[i];
+		rknpu_obj->pin_count++;
+		list_move_tail(&rknpu_obj->evict_head, &evict->lru);
+	}
+	for (i = 0; i < resident->nr && !ret; i++) {
+		if (resident->objs[i]->evicted)
+			ret = rknpu_mem_evict_load(rknpu_dev, resident->objs[i]);
+	}
+	mutex_unlock(&evict->lock);
+
+	return ret;
+}
+
+/*
+ * Bring back and pin the evictable BOs among the @count handles of
+ * @session in @handles for a SUBMIT; views stand for their parent BO.
+ * Returns NULL if none of them is evictable.
+ */
+static struct rknpu_mem_resident *
+rknpu_mem_make_resident_handles(struct rknpu_session *session,
+				const u32 *handles, unsigned int count)
+{
+	struct rknpu_device *rknpu_dev = session->rknpu_dev;
+	struct rknpu_mem_resident *resident;
+	struct rknpu_mem_object *rknpu_obj;
+	unsigned int i, j;
+	int ret;
+
+	resident = kzalloc(struct_size(resident, objs, count), GFP_KERNEL);
+	if (!resident)
+		return ERR_PTR(-ENOMEM);
+	resident->rknpu_dev = rknpu_dev;
+
+	for (i = 0; i < count; i++) {
+		rknpu_obj = rknpu_mem_obj_lookup_handle(session, handles[i]);
+		if (!rknpu_obj) {
+			LOG_ERROR("submit: invalid BO handle %u\n", handles[i]);
+			ret = -EINVAL;
+			goto err_put;
+		}
+		if (rknpu_obj->parent) {
+			rknpu_mem_obj_get(rknpu_obj->parent);
+			rknpu_mem_obj_put(rknpu_obj);
+			rknpu_obj = rknpu_obj->parent;
+		}
+
+		for (j = 0; j < resident->nr; j++) {
+			if (resident->objs[j] == rknpu_obj)
+				break;
+		}
+		if (!(rknpu_obj->flags & RKNPU_MEM_EVICTABLE) ||
+		    j < resident->nr) {
+			rknpu_mem_obj_put(rknpu_obj);
+			continue;
+		}
+		resident->objs[resident->nr++] = rknpu_obj;
+	}
+
+	if (!resident->nr) {
+		kfree(resident);
+		return NULL;
+	}
+
+	ret = rknpu_mem_resident_load(resident);
+	if (ret) {
+		rknpu_mem_resident_put(resident);
+		return ERR_PTR(ret);
+	}
+
+	return resident;
+
+err_put:
+	rknpu_mem_resident_free(resident);
+	return ERR_PTR(ret);
+}
+
+/*
+ * Bring back and pin the evictable BOs a SUBMIT uses: those among the
+ * @count handles in @handles, or every one of @session if userspace did
+ * not name them. Returns NULL if there are none.
+ */
+struct rknpu_mem_resident *
+rknpu_mem_make_resident(struct rknpu_session *session, const u32 *handles,
+			unsigned int count)
+{
+	struct rknpu_device *rknpu_dev = session->rknpu_dev;
+	struct rknpu_mem_evict *evict = rknpu_dev->mem_evict;
+	struct rknpu_mem_resident *resident;
+	struct rknpu_mem_object *rknpu_obj;
+	unsigned int nr;
+	int ret;
+
+	if (!evict)
+		return NULL;
+
+	if (count)
+		return rknpu_mem_make_resident_handles(session, handles, count);
+
+again:
+	nr = 0;
+	spin_lock(&rknpu_dev->lock);
+	list_for_each_entry(rknpu_obj, &session->list, head) {
+		if ((rknpu_obj->flags & RKNPU_MEM_EVICTABLE) && !rknpu_obj->parent)
+			nr++;
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	if (!nr)
+		return NULL;
+
+	resident = kzalloc(struct_size(resident, objs, nr), GFP_KERNEL);
+	if (!resident)
+		return ERR_PTR(-ENOMEM);
+	resident->rknpu_dev = rknpu_dev;
+
+	spin_lock(&rknpu_dev->lock);
+	list_for_each_entry(rknpu_obj, &session->list, head) {
+		if (!(rknpu_obj->flags & RKNPU_MEM_EVICTABLE) ||
+		    rknpu_obj->parent)
+			continue;
+		if (resident->nr == nr) {
+			/* Created meanwhile, count again */
+			resident->nr++;
+			break;
+		}
+		rknpu_mem_obj_get(rknpu_obj);
+		resident->objs[resident->nr++] = rknpu_obj;
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	if (resident->nr > nr) {
+		resident->nr = nr;
+		rknpu_mem_resident_free(resident);
+		goto again;
+	}
+
+	ret = rknpu_mem_resident_load(resident);
+	if (ret) {
+		rknpu_mem_resident_put(resident);
+		return ERR_PTR(ret);
+	}
+
+	return resident;
+}
+
+void rknpu_mem_resident_put(struct rknpu_mem_resident *resident)
+{
+	struct rknpu_mem_evict *evict;
+	unsigned int i;
+
+	if (!resident)
+		return;
+
+	evict = resident->rknpu_dev->mem_evict;
+
+	mutex_lock(&evict->lock);
+	for (i = 0; i < resident->nr; i++)
+		resident->objs[i]->pin_count--;
+	mutex_unlock(&evict->lock);
+
+	for (i = 0; i < resident->nr; i++)
+		rknpu_mem_obj_put(resident->objs[i]);
+	kfree(resident);
+}
+
+int rknpu_mem_evict_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct rknpu_mem_evict *evict;
+	struct rknpu_mem_object *rknpu_obj;
+
+	if (!rknpu_dev || !rknpu_dev->mem_evict) {
+		seq_puts(s, "no eviction (needs the IOMMU)\n");
+		return 0;
+	}
+
+	evict = rknpu_dev->mem_evict;
+
+	mutex_lock(&evict->lock);
+	seq_printf(s, "budget: %zu\n",
+		   (size_t)READ_ONCE(evict_budget_mb) << 20);
+	seq_printf(s, "resident: %zu\n", evict->resident);
+	seq_printf(s, "evicted: %zu\n", evict->evicted);
+	seq_printf(s, "evictions: %llu\n", evict->evictions);
+	seq_printf(s, "restores: %llu\n", evict->restores);
+	seq_printf(s, "restore_avg_us: %llu\n",
+		   evict->restores ?
+			   div64_u64(evict->restore_ns,
+				     evict->restores * NSEC_PER_USEC) : 0);
+	seq_printf(s, "restore_max_us: %llu\n",
+		   evict->restore_ns_max / NSEC_PER_USEC);
+	seq_printf(s, "failures: %llu\n", evict->failures);
+
+	/* Least recently used first */
+	seq_puts(s, "# dma_addr size state pins refs\n");
+	list_for_each_entry(rknpu_obj, &evict->lru, evict_head) {
+		seq_printf(s, "%#llx %lu %s %u %u\n",
+			   (u64)rknpu_obj->dma_addr, rknpu_obj->size,
+			   rknpu_obj->evicted ? "evicted" : "resident",
+			   rknpu_obj->pin_count,
+			   kref_read(&rknpu_obj->refcount));
+	}
+	mutex_unlock(&evict->lock);
+
+	return 0;
+}
@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * DMA-BUF exporter for driver-allocated (Path B) buffers.
+ *
+ * MEM_EXPORT wraps a BO in a dma-buf so other devices (GPU via EGLImage,
+ * MPP encoder, V4L2) can consume NPU output tensors without a CPU copy.
+ * Each exported dma-buf holds a reference on the BO, so the session may
+ * destroy its handle while importers still use the memory.
+ */
+
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/fcntl.h>
+#include <linux/fs.h>
+#include <linux/iosys-map.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "rknpu_carveout.h"
+#include "rknpu_drv.h"
+#include "rknpu_ioctl.h"
+#include "rknpu_mem.h"
+
+struct rknpu_export_attachment {
+	struct list_head head;
+	struct device *dev;
+	struct sg_table sgt;
+	bool mapped;
+};
+
+static int rknpu_export_attach(struct dma_buf *dmabuf,
+			       struct dma_buf_attachment *attach)
+{
+	struct rknpu_mem_object *rknpu_obj = dmabuf->priv;
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+	struct rknpu_export_attachment *a;
+	int ret;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+
+	if (rknpu_obj->pages)
+		ret = sg_alloc_table_from_pages(&a->sgt, rknpu_obj->pages,
+						rknpu_obj->num_pages, 0,
+						rknpu_obj->size, GFP_KERNEL);
+	else
+		ret = dma_get_sgtable(rknpu_dev->dev, &a->sgt,
+				      rknpu_obj->kv_addr, rknpu_obj->dma_addr,
+				      rknpu_obj->size);
+	if (ret) {
+		LOG_ERROR("export: failed to build sg table: %d\n", ret);
+		kfree(a);
+		return ret;
+	}
+
+	a->dev = attach->dev;
+	attach->priv = a;
+
+	mutex_lock(&rknpu_obj->export_lock);
+	list_add(&a->head, &rknpu_obj->attachments);
+	mutex_unlock(&rknpu_obj->export_lock);
+
+	return 0;
+}
+
+static void rknpu_export_detach(struct dma_buf *dmabuf,
+				struct dma_buf_attachment *attach)
+{
+	struct rknpu_mem_object *rknpu_obj = dmabuf->priv;
+	struct rknpu_export_attachment *a = attach->priv;
+
+	mutex_lock(&rknpu_obj->export_lock);
+	list_del(&a->head);
+	mutex_unlock(&rknpu_obj->export_lock);
+
+	sg_free_table(&a->sgt);
+	kfree(a);
+}
+
+static struct sg_table *
+rknpu_export_map_dma_buf(struct dma_buf_attachment *attach,
+			 enum dma_data_direction dir)
+{
+	struct rknpu_export_attachment *a = attach->priv;
+	int ret;
+
+	ret = dma_map_sgtable(attach->dev, &a->sgt, dir, 0);
+	if (ret)
+		return ERR_PTR(ret);
+
+	a->mapped = true;
+
+	return &a->sgt;
+}
+
+static void rknpu_export_unmap_dma_buf(struct dma_buf_attachment *attach,
+				       struct sg_table *sgt,
+				       enum dma_data_direction dir)
+{
+	struct rknpu_export_attachment *a = attach->priv;
+
+	a->mapped = false;
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+}
+
+static int rknpu_export_begin_cpu_access(struct dma_buf *dmabuf,
+					 enum dma_data_direction dir)
+{
+	struct rknpu_mem_object *rknpu_obj = dmabuf->priv;
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+	struct rknpu_export_attachment *a;
+
+	mutex_lock(&rknpu_obj->export_lock);
+
+	if (rknpu_obj->sgt && (rknpu_obj->flags & RKNPU_MEM_CACHEABLE))
+		dma_sync_sgtable_for_cpu(rknpu_dev->dev, rknpu_obj->sgt, dir);
+
+	list_for_each_entry(a, &rknpu_obj->attachments, head) {
+		if (a->mapped)
+			dma_sync_sgtable_for_cpu(a->dev, &a->sgt, dir);
+	}
+
+	mutex_unlock(&rknpu_obj->export_lock);
+
+	return 0;
+}
+
+static int rknpu_export_end_cpu_access(struct dma_buf *dmabuf,
+				       enum dma_data_direction dir)
+{
+	struct rknpu_mem_object *rknpu_obj = dmabuf->priv;
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+	struct rknpu_export_attachment *a;
+
+	mutex_lock(&rknpu_obj->export_lock);
+
+	if (rknpu_obj->sgt && (rknpu_obj->flags & RKNPU_MEM_CACHEABLE))
+		dma_sync_sgtable_for_device(rknpu_dev->dev, rknpu_obj->sgt,
+					    dir);
+
+	list_for_each_entry(a, &rknpu_obj->attachments, head) {
+		if (a->mapped)
+			dma_sync_sgtable_for_device(a->dev, &a->sgt, dir);
+	}
+
+	mutex_unlock(&rknpu_obj->export_lock);
+
+	return 0;
+}
+
+static int rknpu_export_mmap(struct dma_buf *dmabuf,
+			     struct vm_area_struct *vma)
+{
+	struct rknpu_mem_object *rknpu_obj = dmabuf->priv;
+
+	/* Read-only exports must not be mapped writable, now or later */
+	if (!(dmabuf->file->f_mode & FMODE_WRITE)) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		vm_flags_clear(vma, VM_MAYWRITE);
+	}
+
+	return rknpu_mem_mmap_obj(rknpu_obj->rknpu_dev, rknpu_obj, vma);
+}
+
+static int rknpu_export_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct rknpu_mem_object *rknpu_obj = dmabuf->priv;
+
+	if (!rknpu_obj->kv_addr)
+		return -ENOMEM;
+
+	iosys_map_set_vaddr(map, rknpu_obj->kv_addr);
+
+	return 0;
+}
+
+static void rknpu_export_release(struct dma_buf *dmabuf)
+{
+	struct rknpu_mem_object *rknpu_obj = dmabuf->priv;
+
+	rknpu_mem_obj_put(rknpu_obj);
+}
+
+static const struct dma_buf_ops rknpu_export_dmabuf_ops = {
+	.attach = rknpu_export_attach,
+	.detach = rknpu_export_detach,
+	.map_dma_buf = rknpu_export_map_dma_buf,
+	.unmap_dma_buf = rknpu_export_unmap_dma_buf,
+	.begin_cpu_access = rknpu_export_begin_cpu_access,
+	.end_cpu_access = rknpu_export_end_cpu_access,
+	.mmap = rknpu_export_mmap,
+	.vmap = rknpu_export_vmap,
+	.release = rknpu_export_release,
+};
+
+int rknpu_mem_export_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			   unsigned long data)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct rknpu_mem_object *rknpu_obj;
+	struct rknpu_mem_export args;
+	struct dma_buf *dmabuf;
+	int ret;
+
+	if (unlikely(copy_from_user(&args,
+				    (struct rknpu_mem_export __user *)data,
+				    sizeof(args)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		return -EFAULT;
+	}
+
+	if (args.flags & ~(O_CLOEXEC | O_ACCMODE) ||
+	    (args.flags & O_ACCMODE) == O_ACCMODE)
+		return -EINVAL;
+
+	rknpu_obj = rknpu_mem_obj_lookup(rknpu_dev, file, args.obj_addr);
+	if (!rknpu_obj) {
+		LOG_ERROR("export: invalid obj_addr %#llx\n", args.obj_addr);
+		return -EINVAL;
+	}
+
+	/*
+	 * Imported BOs already are DMA-BUFs, share the original fd instead.
+	 * SRAM has no pages to hand to importers, and neither has a no-map
+	 * carveout: it is outside the kernel's memory map, so
+	 * dma_get_sgtable() cannot describe it. Shared constant BOs must stay
+	 * read-only, userptr memory belongs to the process that registered
+	 * it and evictable BOs give up their pages.
+	 */
+	mutex_lock(&rknpu_obj->export_lock);
+	if (!rknpu_obj->owner || rknpu_obj->sram_size || rknpu_obj->shared ||
+	    rknpu_obj->parent ||
+	    (rknpu_obj->carveout_phys && !rknpu_dev->carveout->reusable) ||
+	    (rknpu_obj->flags & (RKNPU_MEM_USERPTR | RKNPU_MEM_EVICTABLE))) {
+		mutex_unlock(&rknpu_obj->export_lock);
+		ret = -EINVAL;
+		goto err_put_obj;
+	}
+
+	exp_info.ops = &rknpu_export_dmabuf_ops;
+	exp_info.size = rknpu_obj->size;
+	exp_info.flags = args.flags & (O_ACCMODE | O_CLOEXEC);
+	exp_info.priv = rknpu_obj;
+
+	/* On success the dma-buf owns the lookup reference */
+	dmabuf = dma_buf_export(&exp_info);
+	mutex_unlock(&rknpu_obj->export_lock);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		LOG_ERROR("export: dma_buf_export failed: %d\n", ret);
+		goto err_put_obj;
+	}
+
+	args.fd = dma_buf_fd(dmabuf, args.flags & O_CLOEXEC);
+	if (args.fd < 0) {
+		ret = args.fd;
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+
+	LOG_DEBUG("export: obj=%#llx dma=%#llx size=%lu fd=%d\n",
+		  args.obj_addr, (__u64)rknpu_obj->dma_addr, rknpu_obj->size,
+		  args.fd);
+
+	if (unlikely(copy_to_user((struct rknpu_mem_export __user *)data,
+				  &args, sizeof(args)))) {
+		/* The fd is installed; userspace still owns and can close it */
+		LOG_ERROR("%s: copy_to_user failed\n", __func__);
+		return -EFAULT;
+	}
+
+	return 0;
+
+err_put_obj:
+	rknpu_mem_obj_put(rknpu_obj);
+	return ret;
+}
@@ -0,0 +1,480 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Recycling pool for freed dma_alloc_coherent BOs.
+ *
+ * librknnrt and the NIF create and destroy many short-lived buffers around
+ * every context init and request. Each of those costs a zeroed
+ * dma_alloc_coherent() plus IOMMU mapping. Freed coherent BOs are instead
+ * parked in power-of-two size buckets and handed back by MEM_CREATE. A
+ * pooled BO may go to any session, so it is always cleared before it is
+ * handed out.
+ *
+ * The pool is capped (oldest BOs are freed first) and registers a shrinker
+ * so parked memory is given back under memory pressure.
+ *
+ * Zeroing 64 MB synchronously inside MEM_CREATE shows up in model load
+ * time, so clearing happens in a background work item instead: pooled BOs
+ * are cleared after they are parked, and a small reserve of pre-zeroed
+ * page blocks is kept for page-array allocations.
+ */
+
+#include <linux/dma-mapping.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+#include "rknpu_drv.h"
+#include "rknpu_mem.h"
+#include "rknpu_mem_pool.h"
+
+static unsigned int mem_pool_size_mb = 64;
+module_param(mem_pool_size_mb, uint, 0444);
+MODULE_PARM_DESC(mem_pool_size_mb,
+		 "cap of the freed coherent BO pool in MB, 0 disables it, 64 by default");
+
+static unsigned int mem_zero_reserve_mb = 16;
+module_param(mem_zero_reserve_mb, uint, 0444);
+MODULE_PARM_DESC(mem_zero_reserve_mb,
+		 "pre-zeroed page reserve in MB, 0 disables it, 16 by default");
+
+struct rknpu_mem_pool_entry {
+	struct list_head bucket_head;
+	struct list_head lru_head;
+	int bucket;
+	bool zeroed;
+	void *kv_addr;
+	dma_addr_t dma_addr;
+	size_t size;
+};
+
+/* Must be called with pool->lock held */
+static void rknpu_mem_pool_add(struct rknpu_mem_pool *pool,
+			       struct rknpu_mem_pool_entry *entry)
+{
+	list_add(&entry->bucket_head, &pool->buckets[entry->bucket]);
+	list_add_tail(&entry->lru_head, &pool->lru);
+	pool->count[entry->bucket]++;
+	pool->bytes += entry->size;
+}
+
+static int rknpu_mem_pool_bucket(size_t size)
+{
+	return ilog2(size >> PAGE_SHIFT);
+}
+
+/* Must be called with pool->lock held */
+static void rknpu_mem_pool_unlink(struct rknpu_mem_pool *pool,
+				  struct rknpu_mem_pool_entry *entry)
+{
+	list_del(&entry->bucket_head);
+	list_del(&entry->lru_head);
+	pool->count[entry->bucket]--;
+	pool->bytes -= entry->size;
+}
+
+static void rknpu_mem_pool_free_list(struct rknpu_mem_pool *pool,
+				     struct list_head *list)
+{
+	struct rknpu_mem_pool_entry *entry, *q;
+
+	list_for_each_entry_safe(entry, q, list, lru_head) {
+		list_del(&entry->lru_head);
+		dma_free_coherent(pool->rknpu_dev->dev, entry->size,
+				  entry->kv_addr, entry->dma_addr);
+		kfree(entry);
+	}
+}
+
+/*
+ * Hand a pooled BO to @rknpu_obj if one fits @size. A BO fits if it is
+ * at least @size and wastes at most a quarter of it; both the bucket of
+ * @size and the next one up are searched. BOs already cleared in the
+ * background are preferred, any other BO is cleared here.
+ */
+bool rknpu_mem_pool_get(struct rknpu_device *rknpu_dev,
+			struct rknpu_mem_object *rknpu_obj, size_t size)
+{
+	struct rknpu_mem_pool *pool = rknpu_dev->mem_pool;
+	struct rknpu_mem_pool_entry *entry, *found = NULL;
+	int bucket, b;
+
+	if (!pool || !pool->max_bytes)
+		return false;
+
+	bucket = rknpu_mem_pool_bucket(size);
+	if (bucket >= RKNPU_MEM_POOL_BUCKETS)
+		return false;
+
+	spin_lock(&pool->lock);
+	for (b = bucket; b <= bucket + 1 && b < RKNPU_MEM_POOL_BUCKETS; b++) {
+		list_for_each_entry(entry, &pool->buckets[b], bucket_head) {
+			if (entry->size < size || entry->size > size + size / 4)
+				continue;
+			if (!found || (entry->zeroed && !found->zeroed))
+				found = entry;
+			if (found->zeroed)
+				break;
+		}
+		if (found && found->zeroed)
+			break;
+	}
+
+	if (found) {
+		rknpu_mem_pool_unlink(pool, found);
+		pool->hits++;
+		if (!found->zeroed)
+			pool->zero_sync_bytes += found->size;
+	} else {
+		pool->misses++;
+	}
+	spin_unlock(&pool->lock);
+
+	if (!found)
+		return false;
+
+	if (!found->zeroed)
+		memset(found->kv_addr, 0, found->size);
+
+	rknpu_obj->kv_addr = found->kv_addr;
+	rknpu_obj->dma_addr = found->dma_addr;
+	rknpu_obj->size = found->size;
+	kfree(found);
+
+	return true;
+}
+
+/*
+ * Park a coherent BO in the pool instead of freeing it. Returns false if
+ * the caller still has to free the memory itself.
+ */
+bool rknpu_mem_pool_put(struct rknpu_device *rknpu_dev,
+			struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_mem_pool *pool = rknpu_dev->mem_pool;
+	struct rknpu_mem_pool_entry *entry, *q;
+	LIST_HEAD(evict_list);
+	int bucket;
+
+	if (!pool || !pool->max_bytes || rknpu_obj->size > pool->max_bytes)
+		return false;
+
+	bucket = rknpu_mem_pool_bucket(rknpu_obj->size);
+	if (bucket >= RKNPU_MEM_POOL_BUCKETS)
+		return false;
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return false;
+
+	entry->bucket = bucket;
+	entry->zeroed = false;
+	entry->kv_addr = rknpu_obj->kv_addr;
+	entry->dma_addr = rknpu_obj->dma_addr;
+	entry->size = rknpu_obj->size;
+
+	spin_lock(&pool->lock);
+	rknpu_mem_pool_add(pool, entry);
+
+	list_for_each_entry_safe(entry, q, &pool->lru, lru_head) {
+		if (pool->bytes <= pool->max_bytes)
+			break;
+		rknpu_mem_pool_unlink(pool, entry);
+		list_add_tail(&entry->lru_head, &evict_list);
+		pool->evicted++;
+	}
+	spin_unlock(&pool->lock);
+
+	rknpu_mem_pool_free_list(pool, &evict_list);
+
+	queue_work(system_unbound_wq, &pool->zero_work);
+
+	return true;
+}
+
+/*
+ * Take one pre-zeroed RKNPU_MEM_ZERO_CHUNK block (not split) from the
+ * reserve, or NULL if it is empty. The reserve is refilled in the
+ * background.
+ */
+struct page *rknpu_mem_pool_get_zeroed(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_mem_pool *pool = rknpu_dev->mem_pool;
+	struct page *page = NULL;
+
+	if (!pool || !pool->zero_target)
+		return NULL;
+
+	spin_lock(&pool->lock);
+	page = list_first_entry_or_null(&pool->zero_chunks, struct page, lru);
+	if (page) {
+		list_del(&page->lru);
+		pool->zero_nr--;
+		pool->zero_hits++;
+	}
+	spin_unlock(&pool->lock);
+
+	queue_work(system_unbound_wq, &pool->zero_work);
+
+	return page;
+}
+
+static void rknpu_mem_pool_zero_work(struct work_struct *work)
+{
+	struct rknpu_mem_pool *pool =
+		container_of(work, struct rknpu_mem_pool, zero_work);
+	unsigned int order = get_order(RKNPU_MEM_ZERO_CHUNK);
+	struct rknpu_mem_pool_entry *entry;
+	struct page *page;
+
+	/* Clear parked BOs one at a time; they are invisible meanwhile */
+	for (;;) {
+		bool found = false;
+
+		spin_lock(&pool->lock);
+		list_for_each_entry(entry, &pool->lru, lru_head) {
+			if (!entry->zeroed) {
+				rknpu_mem_pool_unlink(pool, entry);
+				found = true;
+				break;
+			}
+		}
+		spin_unlock(&pool->lock);
+
+		if (!found)
+			break;
+
+		memset(entry->kv_addr, 0, entry->size);
+		entry->zeroed = true;
+
+		spin_lock(&pool->lock);
+		pool->zero_bg_bytes += entry->size;
+		if (pool->bytes + entry->size <= pool->max_bytes) {
+			rknpu_mem_pool_add(pool, entry);
+			entry = NULL;
+		}
+		spin_unlock(&pool->lock);
+
+		/* Pool was shrunk or torn down while we cleared it */
+		if (entry) {
+			dma_free_coherent(pool->rknpu_dev->dev, entry->size,
+					  entry->kv_addr, entry->dma_addr);
+			kfree(entry);
+		}
+
+		cond_resched();
+	}
+
+	/* Refill the pre-zeroed page reserve */
+	for (;;) {
+		spin_lock(&pool->lock);
+		if (pool->zero_nr >= pool->zero_target) {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		spin_unlock(&pool->lock);
+
+		page = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NORETRY |
+				   __GFP_NOWARN, order);
+		if (!page)
+			break;
+
+		spin_lock(&pool->lock);
+		list_add_tail(&page->lru, &pool->zero_chunks);
+		pool->zero_nr++;
+		pool->zero_bg_bytes += RKNPU_MEM_ZERO_CHUNK;
+		spin_unlock(&pool->lock);
+
+		cond_resched();
+	}
+}
+
+/* Must be called with pool->lock held; returns the number of pages moved */
+static unsigned long rknpu_mem_pool_take_zeroed(struct rknpu_mem_pool *pool,
+						struct list_head *list,
+						unsigned long nr_pages)
+{
+	unsigned long chunk_pages = RKNPU_MEM_ZERO_CHUNK >> PAGE_SHIFT;
+	unsigned long taken = 0;
+	struct page *page, *q;
+
+	list_for_each_entry_safe(page, q, &pool->zero_chunks, lru) {
+		if (taken >= nr_pages)
+			break;
+		list_move_tail(&page->lru, list);
+		pool->zero_nr--;
+		taken += chunk_pages;
+	}
+
+	return taken;
+}
+
+static void rknpu_mem_pool_free_zeroed(struct list_head *list)
+{
+	unsigned int order = get_order(RKNPU_MEM_ZERO_CHUNK);
+	struct page *page, *q;
+
+	list_for_each_entry_safe(page, q, list, lru) {
+		list_del(&page->lru);
+		__free_pages(page, order);
+	}
+}
+
+static unsigned long rknpu_mem_pool_count(struct shrinker *shrinker,
+					  struct shrink_control *sc)
+{
+	struct rknpu_mem_pool *pool = shrinker->private_data;
+	unsigned long pages;
+
+	spin_lock(&pool->lock);
+	pages = (pool->bytes >> PAGE_SHIFT) +
+		pool->zero_nr * (RKNPU_MEM_ZERO_CHUNK >> PAGE_SHIFT);
+	spin_unlock(&pool->lock);
+
+	return pages ? pages : SHRINK_EMPTY;
+}
+
+static unsigned long rknpu_mem_pool_scan(struct shrinker *shrinker,
+					 struct shrink_control *sc)
+{
+	struct rknpu_mem_pool *pool = shrinker->private_data;
+	struct rknpu_mem_pool_entry *entry, *q;
+	unsigned long freed = 0;
+	LIST_HEAD(free_list);
+	LIST_HEAD(zero_list);
+
+	spin_lock(&pool->lock);
+	freed = rknpu_mem_pool_take_zeroed(pool, &zero_list, sc->nr_to_scan);
+	list_for_each_entry_safe(entry, q, &pool->lru, lru_head) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		rknpu_mem_pool_unlink(pool, entry);
+		list_add_tail(&entry->lru_head, &free_list);
+		freed += entry->size >> PAGE_SHIFT;
+		pool->shrunk++;
+	}
+	spin_unlock(&pool->lock);
+
+	rknpu_mem_pool_free_zeroed(&zero_list);
+	rknpu_mem_pool_free_list(pool, &free_list);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+int rknpu_mem_pool_init(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_mem_pool *pool;
+	int i;
+
+	pool = devm_kzalloc(rknpu_dev->dev, sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return -ENOMEM;
+
+	pool->rknpu_dev = rknpu_dev;
+	pool->max_bytes = (size_t)mem_pool_size_mb << 20;
+	pool->zero_target = ((size_t)mem_zero_reserve_mb << 20) /
+			    RKNPU_MEM_ZERO_CHUNK;
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->lru);
+	INIT_LIST_HEAD(&pool->zero_chunks);
+	INIT_WORK(&pool->zero_work, rknpu_mem_pool_zero_work);
+	for (i = 0; i < RKNPU_MEM_POOL_BUCKETS; i++)
+		INIT_LIST_HEAD(&pool->buckets[i]);
+
+	pool->shrinker = shrinker_alloc(0, "rknpu-bo-pool");
+	if (!pool->shrinker) {
+		LOG_DEV_WARN(rknpu_dev->dev,
+			     "no shrinker, BO pool disabled\n");
+		pool->max_bytes = 0;
+		pool->zero_target = 0;
+	} else {
+		pool->shrinker->count_objects = rknpu_mem_pool_count;
+		pool->shrinker->scan_objects = rknpu_mem_pool_scan;
+		pool->shrinker->private_data = pool;
+		shrinker_register(pool->shrinker);
+	}
+
+	rknpu_dev->mem_pool = pool;
+
+	if (pool->zero_target)
+		queue_work(system_unbound_wq, &pool->zero_work);
+
+	return 0;
+}
+
+void rknpu_mem_pool_fini(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_mem_pool *pool = rknpu_dev->mem_pool;
+	LIST_HEAD(free_list);
+	LIST_HEAD(zero_list);
+	int i;
+
+	if (!pool)
+		return;
+
+	if (pool->shrinker)
+		shrinker_free(pool->shrinker);
+
+	spin_lock(&pool->lock);
+	pool->max_bytes = 0;
+	pool->zero_target = 0;
+	spin_unlock(&pool->lock);
+
+	cancel_work_sync(&pool->zero_work);
+
+	spin_lock(&pool->lock);
+	list_splice_init(&pool->zero_chunks, &zero_list);
+	pool->zero_nr = 0;
+	list_splice_init(&pool->lru, &free_list);
+	for (i = 0; i < RKNPU_MEM_POOL_BUCKETS; i++) {
+		INIT_LIST_HEAD(&pool->buckets[i]);
+		pool->count[i] = 0;
+	}
+	pool->bytes = 0;
+	spin_unlock(&pool->lock);
+
+	rknpu_mem_pool_free_zeroed(&zero_list);
+	rknpu_mem_pool_free_list(pool, &free_list);
+}
+
+int rknpu_mem_pool_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct rknpu_mem_pool *pool;
+	u64 lookups;
+	int i;
+
+	if (!rknpu_dev || !rknpu_dev->mem_pool)
+		return -ENODEV;
+
+	pool = rknpu_dev->mem_pool;
+
+	spin_lock(&pool->lock);
+	lookups = pool->hits + pool->misses;
+	seq_printf(s, "bytes: %zu / %zu\n", pool->bytes, pool->max_bytes);
+	seq_printf(s, "hits: %llu\n", pool->hits);
+	seq_printf(s, "misses: %llu\n", pool->misses);
+	seq_printf(s, "hit_rate: %llu%%\n",
+		   lookups ? div64_u64(pool->hits * 100, lookups) : 0);
+	seq_printf(s, "evicted: %llu\n", pool->evicted);
+	seq_printf(s, "shrunk: %llu\n", pool->shrunk);
+	seq_printf(s, "zero_reserve: %lu / %lu chunks of %u\n",
+		   pool->zero_nr, pool->zero_target, RKNPU_MEM_ZERO_CHUNK);
+	seq_printf(s, "zero_reserve_hits: %llu\n", pool->zero_hits);
+	seq_printf(s, "zeroed_background_bytes: %llu\n", pool->zero_bg_bytes);
+	seq_printf(s, "zeroed_sync_bytes: %llu\n", pool->zero_sync_bytes);
+	seq_puts(s, "# bucket(min size) count\n");
+	for (i = 0; i < RKNPU_MEM_POOL_BUCKETS; i++) {
+		if (pool->count[i])
+			seq_printf(s, "%lu %lu\n", PAGE_SIZE << i,
+				   pool->count[i]);
+	}
+	spin_unlock(&pool->lock);
+
+	return 0;
+}
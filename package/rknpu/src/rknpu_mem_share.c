@@ -0,0 +1,318 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * Cross-session sharing of read-only constant BOs (model weights).
+ *
+ * Several processes running the same model each load their own copy of
+ * the weights. MEM_SHARE lets a session turn a driver-allocated page-array
+ * BO into a reference to one device-wide copy keyed by the SHA-256 of its
+ * contents. The kernel recomputes the hash, so a key can only be used by
+ * a session that already holds exactly that data.
+ *
+ * The first session's data is copied into a private backing BO that no
+ * one can write; later sessions with the same key just reference it and
+ * their own pages are freed. All sessions share the NPU's IOMMU domain, so
+ * the backing BO is mapped once and every user gets its IOVA. Shared BOs
+ * are read-only: the IOMMU maps the backing without write permission, so a
+ * job of one session cannot corrupt another session's weights, and they
+ * can be mmapped without write access only and cannot be exported.
+ */
+
+#include <crypto/sha2.h>
+#include <linux/dma-mapping.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "rknpu_drv.h"
+#include "rknpu_ioctl.h"
+#include "rknpu_mem.h"
+
+/* Hash in steps of this size so huge BOs do not hog the CPU */
+#define RKNPU_MEM_SHARE_HASH_STEP SZ_1M
+
+/*
+ * rknpu shared BO.
+ *
+ * @head: entry in rknpu_device.shared_bos.
+ * @refcount: one per session BO referencing @backing.
+ * @key: SHA-256 of the contents.
+ * @backing: page-array BO holding the only copy of the data.
+ */
+struct rknpu_mem_shared {
+	struct list_head head;
+	struct kref refcount;
+	u8 key[SHA256_DIGEST_SIZE];
+	struct rknpu_mem_object *backing;
+};
+
+static void rknpu_mem_share_hash(const void *data, size_t size,
+				 u8 out[SHA256_DIGEST_SIZE])
+{
+	struct sha256_ctx ctx;
+	size_t off, len;
+
+	sha256_init(&ctx);
+	for (off = 0; off < size; off += len) {
+		len = min_t(size_t, size - off, RKNPU_MEM_SHARE_HASH_STEP);
+		sha256_update(&ctx, data + off, len);
+		cond_resched();
+	}
+	sha256_final(&ctx, out);
+}
+
+/* Must be called with rknpu_dev->shared_lock held */
+static struct rknpu_mem_shared *
+rknpu_mem_shared_find(struct rknpu_device *rknpu_dev,
+		      const u8 key[SHA256_DIGEST_SIZE], size_t size)
+{
+	struct rknpu_mem_shared *shared;
+
+	list_for_each_entry(shared, &rknpu_dev->shared_bos, head) {
+		if (shared->backing->size == size &&
+		    !memcmp(shared->key, key, SHA256_DIGEST_SIZE) &&
+		    kref_get_unless_zero(&shared->refcount))
+			return shared;
+	}
+
+	return NULL;
+}
+
+/*
+ * Copy @rknpu_obj into a new backing BO and verify @key on the copy, which
+ * userspace cannot modify any more.
+ */
+static struct rknpu_mem_shared *
+rknpu_mem_shared_create(struct rknpu_device *rknpu_dev,
+			struct rknpu_mem_object *rknpu_obj,
+			const u8 key[SHA256_DIGEST_SIZE])
+{
+	struct rknpu_mem_shared *shared;
+	struct rknpu_mem_object *backing;
+	u8 digest[SHA256_DIGEST_SIZE];
+	int ret;
+
+	shared = kzalloc(sizeof(*shared), GFP_KERNEL);
+	if (!shared)
+		return ERR_PTR(-ENOMEM);
+
+	/*
+	 * Cacheable so hashing the copy is fast; cleaned once below. The NPU
+	 * only reads it, so the IOMMU maps it without IOMMU_WRITE.
+	 */
+	backing = rknpu_mem_obj_create_pages(rknpu_dev, rknpu_obj->size,
+					     RKNPU_MEM_CACHEABLE,
+					     DMA_TO_DEVICE);
+	if (IS_ERR(backing)) {
+		ret = PTR_ERR(backing);
+		goto err_free;
+	}
+
+	memcpy(backing->kv_addr, rknpu_obj->kv_addr, rknpu_obj->size);
+	rknpu_mem_share_hash(backing->kv_addr, backing->size, digest);
+	if (memcmp(digest, key, SHA256_DIGEST_SIZE)) {
+		ret = -EBADMSG;
+		goto err_put_backing;
+	}
+
+	dma_sync_sgtable_for_device(rknpu_dev->dev, backing->sgt,
+				    DMA_TO_DEVICE);
+
+	kref_init(&shared->refcount);
+	memcpy(shared->key, key, SHA256_DIGEST_SIZE);
+	shared->backing = backing;
+
+	return shared;
+
+err_put_backing:
+	rknpu_mem_obj_put(backing);
+err_free:
+	kfree(shared);
+	return ERR_PTR(ret);
+}
+
+static void rknpu_mem_shared_release(struct kref *ref)
+{
+	struct rknpu_mem_shared *shared =
+		container_of(ref, struct rknpu_mem_shared, refcount);
+
+	list_del(&shared->head);
+	mutex_unlock(&shared->backing->rknpu_dev->shared_lock);
+
+	rknpu_mem_obj_put(shared->backing);
+	kfree(shared);
+}
+
+void rknpu_mem_shared_put(struct rknpu_mem_shared *shared)
+{
+	kref_put_mutex(&shared->refcount, rknpu_mem_shared_release,
+		       &shared->backing->rknpu_dev->shared_lock);
+}
+
+int rknpu_mem_share_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			  unsigned long data)
+{
+	struct rknpu_session *session = file->private_data;
+	struct rknpu_mem_object *rknpu_obj, *backing;
+	struct rknpu_mem_shared *shared, *found;
+	u8 digest[SHA256_DIGEST_SIZE];
+	struct rknpu_mem_share args;
+	struct page **old_pages;
+	struct sg_table *old_sgt;
+	void *old_kv_addr;
+	unsigned long i;
+	int ret;
+
+	if (unlikely(copy_from_user(&args,
+				    (struct rknpu_mem_share __user *)data,
+				    sizeof(args)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		return -EFAULT;
+	}
+
+	if (args.reserved)
+		return -EINVAL;
+
+	rknpu_obj = rknpu_mem_obj_lookup(rknpu_dev, file, args.obj_addr);
+	if (!rknpu_obj) {
+		LOG_ERROR("share: invalid obj_addr %#llx\n", args.obj_addr);
+		return -EINVAL;
+	}
+
+	/*
+	 * Only plain page-array BOs that nobody else references: an
+	 * exported dma-buf would keep using the private pages. export_lock
+	 * keeps MEM_EXPORT and a second MEM_SHARE out until the switch.
+	 */
+	mutex_lock(&rknpu_obj->export_lock);
+	if (!rknpu_obj->owner || !rknpu_obj->pages || !rknpu_obj->kv_addr ||
+	    rknpu_obj->shared || rknpu_obj->sram_size ||
+	    (rknpu_obj->flags & (RKNPU_MEM_USERPTR | RKNPU_MEM_EVICTABLE)) ||
+	    kref_read(&rknpu_obj->refcount) > 2) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	mutex_lock(&rknpu_dev->shared_lock);
+	shared = rknpu_mem_shared_find(rknpu_dev, args.key, rknpu_obj->size);
+	mutex_unlock(&rknpu_dev->shared_lock);
+
+	if (shared) {
+		/* Only a session that has the data may map the shared copy */
+		rknpu_mem_share_hash(rknpu_obj->kv_addr, rknpu_obj->size,
+				     digest);
+		if (memcmp(digest, args.key, SHA256_DIGEST_SIZE)) {
+			rknpu_mem_shared_put(shared);
+			ret = -EBADMSG;
+			goto out_unlock;
+		}
+		args.joined = 1;
+	} else {
+		shared = rknpu_mem_shared_create(rknpu_dev, rknpu_obj,
+						 args.key);
+		if (IS_ERR(shared)) {
+			ret = PTR_ERR(shared);
+			goto out_unlock;
+		}
+
+		/* Another session may have published the same key meanwhile */
+		mutex_lock(&rknpu_dev->shared_lock);
+		found = rknpu_mem_shared_find(rknpu_dev, args.key,
+					      rknpu_obj->size);
+		if (!found)
+			list_add(&shared->head, &rknpu_dev->shared_bos);
+		mutex_unlock(&rknpu_dev->shared_lock);
+
+		if (found) {
+			rknpu_mem_obj_put(shared->backing);
+			kfree(shared);
+			shared = found;
+			args.joined = 1;
+		} else {
+			args.joined = 0;
+		}
+	}
+
+	backing = shared->backing;
+
+	/* Point the BO at the shared copy, then drop its private pages */
+	spin_lock(&rknpu_dev->lock);
+	rknpu_mem_session_account(session, rknpu_obj, -1);
+	old_pages = rknpu_obj->pages;
+	old_sgt = rknpu_obj->sgt;
+	old_kv_addr = rknpu_obj->kv_addr;
+	rknpu_obj->shared = shared;
+	rknpu_obj->pages = backing->pages;
+	rknpu_obj->sgt = backing->sgt;
+	rknpu_obj->kv_addr = backing->kv_addr;
+	rknpu_obj->dma_addr = backing->dma_addr;
+	rknpu_obj->dma_dir = backing->dma_dir;
+	rknpu_obj->flags |= RKNPU_MEM_CACHEABLE;
+	memcpy(rknpu_obj->nr_chunks, backing->nr_chunks,
+	       sizeof(rknpu_obj->nr_chunks));
+	rknpu_mem_session_account(session, rknpu_obj, 1);
+	spin_unlock(&rknpu_dev->lock);
+
+	vunmap(old_kv_addr);
+	dma_unmap_sgtable(rknpu_dev->dev, old_sgt, DMA_BIDIRECTIONAL, 0);
+	sg_free_table(old_sgt);
+	kfree(old_sgt);
+	for (i = 0; i < rknpu_obj->num_pages; i++)
+		__free_page(old_pages[i]);
+	kvfree(old_pages);
+	mutex_unlock(&rknpu_obj->export_lock);
+
+	args.dma_addr = (__u64)rknpu_obj->dma_addr;
+
+	LOG_DEBUG("share: obj=%#llx size=%lu dma=%#llx joined=%u\n",
+		  args.obj_addr, rknpu_obj->size, args.dma_addr, args.joined);
+
+	ret = 0;
+	if (unlikely(copy_to_user((struct rknpu_mem_share __user *)data,
+				  &args, sizeof(args)))) {
+		LOG_ERROR("%s: copy_to_user failed\n", __func__);
+		ret = -EFAULT;
+	}
+
+	rknpu_mem_obj_put(rknpu_obj);
+	return ret;
+
+out_unlock:
+	mutex_unlock(&rknpu_obj->export_lock);
+	rknpu_mem_obj_put(rknpu_obj);
+	return ret;
+}
+
+int rknpu_mem_shared_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct rknpu_mem_shared *shared;
+	u64 saved = 0;
+
+	if (!rknpu_dev)
+		return -ENODEV;
+
+	seq_puts(s, "# key dma_addr size users\n");
+
+	mutex_lock(&rknpu_dev->shared_lock);
+	list_for_each_entry(shared, &rknpu_dev->shared_bos, head) {
+		unsigned int users = kref_read(&shared->refcount);
+
+		seq_printf(s, "%*phN %#llx %lu %u\n", 8, shared->key,
+			   (u64)shared->backing->dma_addr,
+			   shared->backing->size, users);
+		if (users > 1)
+			saved += (u64)shared->backing->size * (users - 1);
+	}
+	mutex_unlock(&rknpu_dev->shared_lock);
+
+	seq_printf(s, "saved: %llu\n", saved);
+
+	return 0;
+}
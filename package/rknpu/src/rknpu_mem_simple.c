@@ -13,26 +13,1103 @@
  * Path B (handle <= 0): dma_alloc_coherent
  *   Our Rust NIF uses kernel-allocated coherent memory. The handle returned
  *   is a simple counter (not an fd). Userspace mmaps via /dev/rknpu.
+ *
+ *   With RKNPU_MEM_NON_CONTIGUOUS and the IOMMU enabled, the buffer is built
+ *   from individual pages instead. The IOMMU maps them at one contiguous
+ *   IOVA and the kernel sees them through vmap(), so large model buffers no
+ *   longer depend on CMA or on compaction succeeding after long uptimes.
+ *   Pages are taken in 2 MB and 64 KB physically contiguous chunks where
+ *   the buddy allocator has them cheaply, so the IOMMU core can use large
+ *   page mappings and the NPU sees fewer IOTLB misses.
+ *
+ *   With RKNPU_MEM_USERPTR no memory is allocated: the caller's own pages
+ *   (malloc or hugetlb) are pinned and mapped the same way, so tensors
+ *   written by CPU preprocessing need no copy into an NPU buffer.
+ *
+ *   RKNPU_MEM_EVICTABLE page arrays may be written out to shmem while idle,
+ *   see rknpu_mem_evict.c.
+ */
+
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
+#include <linux/iosys-map.h>
+#include <linux/iommu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/uaccess.h>
+
+#include "rknpu_carveout.h"
+#include "rknpu_drv.h"
+#include "rknpu_ioctl.h"
+#include "rknpu_mem.h"
+#include "rknpu_mem_evict.h"
+#include "rknpu_mem_pool.h"
+#include "rknpu_sram.h"
+
+static unsigned int import_cache_size = 16;
+module_param(import_cache_size, uint, 0644);
+MODULE_PARM_DESC(import_cache_size,
+		 "destroyed DMA-BUF imports kept mapped per session for reuse, 16 by default");
+
+static bool mmap_pmd_blocks;
+module_param(mmap_pmd_blocks, bool, 0644);
+MODULE_PARM_DESC(mmap_pmd_blocks,
+		 "map 2 MB chunks of page-array BOs with PMD entries on first touch instead of PTEs at mmap time, off by default");
+
+static const unsigned long rknpu_mem_chunk_sizes[RKNPU_MEM_NR_CHUNK_SIZES] = {
+	SZ_2M,
+	SZ_64K,
+	PAGE_SIZE,
+};
+
+static pgprot_t rknpu_mem_pgprot(struct rknpu_mem_object *rknpu_obj,
+				 pgprot_t prot)
+{
+	if (rknpu_obj->flags & RKNPU_MEM_CACHEABLE)
+		return prot;
+
+	return pgprot_writecombine(prot);
+}
+
+static void rknpu_mem_free_pages(struct rknpu_device *rknpu_dev,
+				 struct rknpu_mem_object *rknpu_obj)
+{
+	unsigned long i;
+
+	if (rknpu_obj->kv_addr)
+		vunmap(rknpu_obj->kv_addr);
+
+	if (rknpu_obj->sgt) {
+		dma_unmap_sgtable(rknpu_dev->dev, rknpu_obj->sgt,
+				  rknpu_obj->dma_dir, 0);
+		sg_free_table(rknpu_obj->sgt);
+		kfree(rknpu_obj->sgt);
+	}
+
+	if (rknpu_obj->flags & RKNPU_MEM_USERPTR) {
+		/* The NPU may have written to any of them */
+		unpin_user_pages_dirty_lock(rknpu_obj->pages,
+					    rknpu_obj->num_pages, true);
+		if (rknpu_obj->pin_mm) {
+			account_locked_vm(rknpu_obj->pin_mm,
+					  rknpu_obj->size >> PAGE_SHIFT, false);
+			mmdrop(rknpu_obj->pin_mm);
+			rknpu_obj->pin_mm = NULL;
+		}
+	} else {
+		for (i = rknpu_obj->sram_size >> PAGE_SHIFT;
+		     i < rknpu_obj->num_pages; i++) {
+			if (rknpu_obj->pages[i])
+				__free_page(rknpu_obj->pages[i]);
+		}
+	}
+	kvfree(rknpu_obj->pages);
+
+	rknpu_obj->kv_addr = NULL;
+	rknpu_obj->sgt = NULL;
+	rknpu_obj->pages = NULL;
+	rknpu_obj->num_pages = 0;
+}
+
+/*
+ * Map the page array of @rknpu_obj through the IOMMU.
+ *
+ * dma_map_sgtable() on an IOMMU-backed device places all page-sized
+ * segments in one IOVA range, so the NPU sees a single contiguous buffer
+ * even though the backing pages are scattered. Anything else (no IOMMU,
+ * or a mapping split into several segments) cannot be used by the NPU.
+ * The NPU gets write access unless the BO's dma_dir is DMA_TO_DEVICE.
+ * Evictable BOs get one table entry per page, so eviction can swap the
+ * pages behind the mapping without rebuilding the table.
+ */
+static int rknpu_mem_map_pages(struct rknpu_device *rknpu_dev,
+			       struct rknpu_mem_object *rknpu_obj)
+{
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return -ENOMEM;
+
+	if (rknpu_obj->flags & RKNPU_MEM_EVICTABLE) {
+		struct scatterlist *sg;
+		unsigned int i;
+
+		ret = sg_alloc_table(sgt, rknpu_obj->num_pages, GFP_KERNEL);
+		if (!ret) {
+			for_each_sgtable_sg(sgt, sg, i)
+				sg_set_page(sg, rknpu_obj->pages[i], PAGE_SIZE,
+					    0);
+		}
+	} else {
+		ret = sg_alloc_table_from_pages(sgt, rknpu_obj->pages,
+						rknpu_obj->num_pages, 0,
+						rknpu_obj->size, GFP_KERNEL);
+	}
+	if (ret) {
+		kfree(sgt);
+		return ret;
+	}
+
+	ret = dma_map_sgtable(rknpu_dev->dev, sgt, rknpu_obj->dma_dir, 0);
+	if (ret) {
+		LOG_ERROR("mem_create: dma_map_sgtable failed: %d\n", ret);
+		sg_free_table(sgt);
+		kfree(sgt);
+		return ret;
+	}
+	rknpu_obj->sgt = sgt;
+
+	if (sgt->nents != 1) {
+		LOG_ERROR("mem_create: IOVA not contiguous (%u segments)\n",
+			  sgt->nents);
+		return -EINVAL;
+	}
+	rknpu_obj->dma_addr = sg_dma_address(sgt->sgl);
+
+	return 0;
+}
+
+/*
+ * Fill the page array of @rknpu_obj after its SRAM head with the largest
+ * chunks available, largest first so that chunk boundaries stay aligned
+ * in the (size-aligned) IOVA range. Large orders must not trigger reclaim
+ * or compaction stalls; fall back to smaller chunks instead. Chunks are
+ * split so every page can be vmapped, mmapped and freed individually.
+ * Pages always come cleared; 64 KB chunks are taken from the pool's
+ * background-zeroed reserve while it lasts, so the clearing mostly
+ * happens off the allocation path. On failure the pages allocated so far
+ * are left in the array for the caller to free.
+ */
+int rknpu_mem_fill_pages(struct rknpu_device *rknpu_dev,
+			 struct rknpu_mem_object *rknpu_obj)
+{
+	unsigned long num_pages = rknpu_obj->num_pages;
+	unsigned long i = rknpu_obj->sram_size >> PAGE_SHIFT;
+
+	while (i < num_pages) {
+		struct page *page = NULL;
+		unsigned int order = 0;
+		unsigned long n;
+		int c;
+
+		for (c = 0; c < RKNPU_MEM_NR_CHUNK_SIZES; c++) {
+			gfp_t gfp = GFP_KERNEL_ACCOUNT | __GFP_ZERO |
+				    __GFP_NOWARN;
+
+			n = rknpu_mem_chunk_sizes[c] >> PAGE_SHIFT;
+			if (!n || num_pages - i < n)
+				continue;
+
+			order = get_order(rknpu_mem_chunk_sizes[c]);
+			if (order)
+				gfp |= __GFP_NORETRY;
+
+			if (rknpu_mem_chunk_sizes[c] == RKNPU_MEM_ZERO_CHUNK) {
+				page = rknpu_mem_pool_get_zeroed(rknpu_dev);
+				if (page)
+					break;
+			}
+
+			page = alloc_pages(gfp, order);
+			if (page)
+				break;
+		}
+
+		if (!page) {
+			LOG_ERROR("mem_create: page %lu/%lu allocation failed\n",
+				  i, num_pages);
+			return -ENOMEM;
+		}
+
+		if (order)
+			split_page(page, order);
+
+		for (n = 0; n < (1UL << order); n++)
+			rknpu_obj->pages[i++] = page + n;
+		rknpu_obj->nr_chunks[c]++;
+	}
+
+	return 0;
+}
+
+/* Kernel mapping of a page-array BO with the BO's cache attributes */
+void *rknpu_mem_vmap_pages(struct rknpu_mem_object *rknpu_obj)
+{
+	return vmap(rknpu_obj->pages, rknpu_obj->num_pages, VM_MAP,
+		    rknpu_mem_pgprot(rknpu_obj, PAGE_KERNEL));
+}
+
+/* Allocate a Path B buffer page by page and map it through the IOMMU */
+static int rknpu_mem_alloc_pages(struct rknpu_device *rknpu_dev,
+				 struct rknpu_mem_object *rknpu_obj)
+{
+	unsigned long num_pages = rknpu_obj->size >> PAGE_SHIFT;
+	unsigned long i;
+	int ret;
+
+	rknpu_obj->pages = kvmalloc_array(num_pages, sizeof(struct page *),
+					  GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+	if (!rknpu_obj->pages)
+		return -ENOMEM;
+	rknpu_obj->num_pages = num_pages;
+	memset(rknpu_obj->nr_chunks, 0, sizeof(rknpu_obj->nr_chunks));
+
+	/* An SRAM head is held by the scratch page until rknpu_sram_map() */
+	for (i = 0; i < rknpu_obj->sram_size >> PAGE_SHIFT; i++)
+		rknpu_obj->pages[i] = rknpu_dev->sram->scratch;
+
+	ret = rknpu_mem_fill_pages(rknpu_dev, rknpu_obj);
+	if (ret)
+		goto err_free;
+
+	ret = rknpu_mem_map_pages(rknpu_dev, rknpu_obj);
+	if (ret)
+		goto err_free;
+
+	if (rknpu_obj->sram_size) {
+		/* SRAM is not CPU mapped, such BOs have no kv_addr */
+		ret = rknpu_sram_map(rknpu_dev, rknpu_obj);
+		if (ret)
+			goto err_free;
+		return 0;
+	}
+
+	rknpu_obj->kv_addr = rknpu_mem_vmap_pages(rknpu_obj);
+	if (!rknpu_obj->kv_addr) {
+		LOG_ERROR("mem_create: vmap of %lu pages failed\n", num_pages);
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	return 0;
+
+err_free:
+	rknpu_mem_free_pages(rknpu_dev, rknpu_obj);
+	return ret;
+}
+
+/*
+ * Pin the user memory at @start for the lifetime of the BO and map it
+ * through the IOMMU. FOLL_LONGTERM migrates the pages out of CMA and
+ * movable zones first. The pages stay cacheable on the CPU side, so
+ * MEM_SYNC does the cache maintenance; the kernel mapping is created on
+ * demand by rknpu_mem_kmap(). The pinned pages are charged to the caller's
+ * locked_vm against RLIMIT_MEMLOCK until the BO is freed, as for other
+ * long-term pinning drivers.
+ */
+static int rknpu_mem_get_userptr(struct rknpu_device *rknpu_dev,
+				 struct rknpu_mem_object *rknpu_obj,
+				 unsigned long start)
+{
+	unsigned long num_pages = rknpu_obj->size >> PAGE_SHIFT;
+	int pinned, ret;
+
+	if (!rknpu_dev->iommu_en || !PAGE_ALIGNED(start) ||
+	    num_pages > INT_MAX)
+		return -EINVAL;
+
+	rknpu_obj->flags = RKNPU_MEM_USERPTR | RKNPU_MEM_NON_CONTIGUOUS |
+			   RKNPU_MEM_CACHEABLE;
+
+	ret = account_locked_vm(current->mm, num_pages, true);
+	if (ret)
+		return ret;
+	mmgrab(current->mm);
+	rknpu_obj->pin_mm = current->mm;
+
+	rknpu_obj->pages = kvmalloc_array(num_pages, sizeof(struct page *),
+					  GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+	if (!rknpu_obj->pages) {
+		ret = -ENOMEM;
+		goto err_unaccount;
+	}
+
+	pinned = pin_user_pages_fast(start, num_pages,
+				     FOLL_WRITE | FOLL_LONGTERM,
+				     rknpu_obj->pages);
+	if (pinned < 0) {
+		kvfree(rknpu_obj->pages);
+		rknpu_obj->pages = NULL;
+		ret = pinned;
+		goto err_unaccount;
+	}
+	rknpu_obj->num_pages = pinned;
+
+	if (pinned != num_pages) {
+		LOG_ERROR("mem_create: pinned %d of %lu user pages at %#lx\n",
+			  pinned, num_pages, start);
+		ret = -EFAULT;
+		goto err_free;
+	}
+
+	ret = rknpu_mem_map_pages(rknpu_dev, rknpu_obj);
+	if (ret)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	rknpu_mem_free_pages(rknpu_dev, rknpu_obj);
+	return ret;
+
+err_unaccount:
+	account_locked_vm(rknpu_obj->pin_mm, num_pages, false);
+	mmdrop(rknpu_obj->pin_mm);
+	rknpu_obj->pin_mm = NULL;
+	return ret;
+}
+
+static void rknpu_mem_obj_free(struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+
+	if (rknpu_obj->parent) {
+		/* View: the memory belongs to the parent BO */
+		rknpu_mem_obj_put(rknpu_obj->parent);
+	} else if (rknpu_obj->shared) {
+		/* Path B: pages belong to the shared backing BO */
+		rknpu_mem_shared_put(rknpu_obj->shared);
+	} else if (rknpu_obj->owner) {
+		if (rknpu_obj->flags & RKNPU_MEM_EVICTABLE)
+			rknpu_mem_evict_del(rknpu_obj);
+		if (rknpu_obj->pages)
+			/* Path B: page array mapped through the IOMMU */
+			rknpu_mem_free_pages(rknpu_dev, rknpu_obj);
+		else if (rknpu_obj->carveout)
+			/* Path B: dedicated reserved-memory region */
+			rknpu_carveout_free(rknpu_dev, rknpu_obj);
+		else if (!rknpu_mem_pool_put(rknpu_dev, rknpu_obj))
+			/* Path B: dma_alloc_coherent */
+			dma_free_coherent(rknpu_dev->dev, rknpu_obj->size,
+					  rknpu_obj->kv_addr,
+					  rknpu_obj->dma_addr);
+		if (rknpu_obj->sram_size)
+			rknpu_sram_free(rknpu_dev, rknpu_obj->sram_phys,
+					rknpu_obj->sram_size);
+	} else {
+		/* Path A: imported DMA-BUF */
+		if (rknpu_obj->kv_addr && rknpu_obj->dmabuf) {
+			struct iosys_map unmap =
+				IOSYS_MAP_INIT_VADDR(rknpu_obj->kv_addr);
+			dma_buf_vunmap_unlocked(rknpu_obj->dmabuf, &unmap);
+		}
+		if (rknpu_obj->sgt && rknpu_obj->attachment)
+			dma_buf_unmap_attachment(rknpu_obj->attachment,
+						 rknpu_obj->sgt,
+						 DMA_BIDIRECTIONAL);
+		if (rknpu_obj->attachment && rknpu_obj->dmabuf)
+			dma_buf_detach(rknpu_obj->dmabuf,
+				       rknpu_obj->attachment);
+		if (rknpu_obj->dmabuf)
+			dma_buf_put(rknpu_obj->dmabuf);
+	}
+	kfree(rknpu_obj);
+}
+
+/*
+ * Unmapping and freeing a large BO or tearing down an import can take
+ * tens of milliseconds, so the last put only queues the BO and
+ * rknpu_mem_free_work() frees it. MEM_DESTROY and close detach BOs from
+ * the session (and its accounting) synchronously.
+ */
+static void rknpu_mem_obj_release(struct kref *ref)
+{
+	struct rknpu_mem_object *rknpu_obj =
+		container_of(ref, struct rknpu_mem_object, refcount);
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+
+	atomic_long_inc(&rknpu_dev->free_pending);
+	atomic_long_add(rknpu_obj->size, &rknpu_dev->free_pending_bytes);
+	atomic64_inc(&rknpu_dev->free_deferred);
+	llist_add(&rknpu_obj->free_node, &rknpu_dev->free_list);
+	queue_work(system_unbound_wq, &rknpu_dev->free_work);
+}
+
+void rknpu_mem_free_work(struct work_struct *work)
+{
+	struct rknpu_device *rknpu_dev =
+		container_of(work, struct rknpu_device, free_work);
+	struct rknpu_mem_object *rknpu_obj, *tmp;
+	struct llist_node *list;
+
+	/* Freeing a view or shared BO may queue its parent or backing BO */
+	while ((list = llist_del_all(&rknpu_dev->free_list))) {
+		llist_for_each_entry_safe(rknpu_obj, tmp, list, free_node) {
+			unsigned long size = rknpu_obj->size;
+
+			rknpu_mem_obj_free(rknpu_obj);
+			atomic_long_sub(size, &rknpu_dev->free_pending_bytes);
+			atomic_long_dec(&rknpu_dev->free_pending);
+			cond_resched();
+		}
+	}
+}
+
+/* Wait until every BO released so far has been freed */
+void rknpu_mem_flush_free(struct rknpu_device *rknpu_dev)
+{
+	do {
+		flush_work(&rknpu_dev->free_work);
+	} while (!llist_empty(&rknpu_dev->free_list));
+}
+
+void rknpu_mem_obj_get(struct rknpu_mem_object *rknpu_obj)
+{
+	kref_get(&rknpu_obj->refcount);
+}
+
+void rknpu_mem_obj_put(struct rknpu_mem_object *rknpu_obj)
+{
+	kref_put(&rknpu_obj->refcount, rknpu_mem_obj_release);
+}
+
+/*
+ * Add (@sign = 1) or remove (@sign = -1) @rknpu_obj from the footprint of
+ * @session. Must be called with rknpu_device.lock held.
+ */
+void rknpu_mem_session_account(struct rknpu_session *session,
+			       struct rknpu_mem_object *rknpu_obj, int sign)
+{
+	u64 *bytes = session->bytes;
+
+	session->nr_bos += sign;
+
+	if (rknpu_obj->parent) {
+		/* Views add no memory of their own */
+	} else if (!rknpu_obj->owner) {
+		bytes[RKNPU_MEM_ACCT_IMPORT] += sign * rknpu_obj->size;
+	} else if (rknpu_obj->shared) {
+		bytes[RKNPU_MEM_ACCT_SHARED] += sign * rknpu_obj->size;
+	} else if (rknpu_obj->flags & RKNPU_MEM_USERPTR) {
+		bytes[RKNPU_MEM_ACCT_USERPTR] += sign * rknpu_obj->size;
+	} else if (rknpu_obj->pages) {
+		bytes[RKNPU_MEM_ACCT_SRAM] += sign * rknpu_obj->sram_size;
+		bytes[RKNPU_MEM_ACCT_PAGES] +=
+			sign * (rknpu_obj->size - rknpu_obj->sram_size);
+	} else {
+		bytes[RKNPU_MEM_ACCT_COHERENT] += sign * rknpu_obj->size;
+	}
+}
+
+static void rknpu_mem_import_stat(struct rknpu_device *rknpu_dev,
+				  ktime_t elapsed)
+{
+	s64 ns = ktime_to_ns(elapsed);
+
+	spin_lock(&rknpu_dev->lock);
+	rknpu_dev->import_count++;
+	rknpu_dev->import_ns += ns;
+	rknpu_dev->import_ns_max = max(rknpu_dev->import_ns_max, ns);
+	spin_unlock(&rknpu_dev->lock);
+}
+
+/*
+ * Move the entries of @session's import cache whose dma-buf nobody else
+ * holds any more to @list. Once the exporter and every other user have
+ * closed it, the cache's reference is all that keeps the buffer alive and
+ * the entry can never be hit again.
+ *
+ * Must be called with rknpu_dev->lock held.
+ */
+static void rknpu_mem_import_cache_prune(struct rknpu_session *session,
+					 struct list_head *list)
+{
+	struct rknpu_mem_object *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, &session->import_cache, head) {
+		if (file_count(entry->dmabuf->file) == 1) {
+			list_move(&entry->head, list);
+			session->nr_cached--;
+		}
+	}
+}
+
+static void rknpu_mem_import_cache_release(struct list_head *list)
+{
+	struct rknpu_mem_object *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, list, head) {
+		list_del(&entry->head);
+		rknpu_mem_obj_put(entry);
+	}
+}
+
+/*
+ * Take the cached import of @dmabuf out of @session's import cache. It
+ * keeps its attachment, IOVA and any kernel mapping. An entry imported
+ * with another size is dropped instead, as are entries of dma-bufs that
+ * were freed everywhere else.
+ */
+static struct rknpu_mem_object *
+rknpu_mem_import_cache_take(struct rknpu_session *session,
+			    struct dma_buf *dmabuf, unsigned long size)
+{
+	struct rknpu_device *rknpu_dev = session->rknpu_dev;
+	struct rknpu_mem_object *entry, *found = NULL;
+	LIST_HEAD(stale_list);
+
+	spin_lock(&rknpu_dev->lock);
+	rknpu_mem_import_cache_prune(session, &stale_list);
+	list_for_each_entry(entry, &session->import_cache, head) {
+		if (entry->dmabuf == dmabuf) {
+			list_del(&entry->head);
+			session->nr_cached--;
+			found = entry;
+			break;
+		}
+	}
+	if (found && found->size == size)
+		rknpu_dev->import_cache_hits++;
+	spin_unlock(&rknpu_dev->lock);
+
+	rknpu_mem_import_cache_release(&stale_list);
+
+	if (found && found->size != size) {
+		rknpu_mem_obj_put(found);
+		found = NULL;
+	}
+
+	return found;
+}
+
+/*
+ * Keep a destroyed import for the next MEM_CREATE of the same dma-buf,
+ * taking over the session's reference. A cached BO keeps its dma-buf
+ * attached and therefore alive, so entries the exporter has already freed
+ * are dropped first, then the cache is bounded by import_cache_size and
+ * the least recently destroyed entries go.
+ */
+static void rknpu_mem_import_cache_put(struct rknpu_session *session,
+				       struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_device *rknpu_dev = session->rknpu_dev;
+	unsigned int max = READ_ONCE(import_cache_size);
+	struct rknpu_mem_object *entry;
+	LIST_HEAD(evict_list);
+
+	spin_lock(&rknpu_dev->lock);
+	list_add(&rknpu_obj->head, &session->import_cache);
+	session->nr_cached++;
+	rknpu_mem_import_cache_prune(session, &evict_list);
+	while (session->nr_cached > max) {
+		entry = list_last_entry(&session->import_cache,
+					struct rknpu_mem_object, head);
+		list_move(&entry->head, &evict_list);
+		session->nr_cached--;
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	rknpu_mem_import_cache_release(&evict_list);
+}
+
+/*
+ * Make sure @rknpu_obj has a kernel mapping. Driver BOs are mapped at
+ * creation (SRAM BOs never); imported and userptr BOs only when SUBMIT
+ * reads task descriptors from them or a debug dump needs their contents.
+ */
+int rknpu_mem_kmap(struct rknpu_mem_object *rknpu_obj)
+{
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+	struct iosys_map map;
+	int ret = 0;
+
+	if (READ_ONCE(rknpu_obj->kv_addr))
+		return 0;
+
+	if (rknpu_obj->parent) {
+		ret = rknpu_mem_kmap(rknpu_obj->parent);
+		if (!ret)
+			WRITE_ONCE(rknpu_obj->kv_addr,
+				   rknpu_obj->parent->kv_addr +
+				   rknpu_obj->offset);
+		return ret;
+	}
+
+	if (rknpu_obj->flags & RKNPU_MEM_USERPTR) {
+		void *vaddr;
+
+		mutex_lock(&rknpu_obj->export_lock);
+		if (!rknpu_obj->kv_addr) {
+			vaddr = vmap(rknpu_obj->pages, rknpu_obj->num_pages,
+				     VM_MAP, PAGE_KERNEL);
+			if (vaddr)
+				WRITE_ONCE(rknpu_obj->kv_addr, vaddr);
+			else
+				ret = -ENOMEM;
+		}
+		mutex_unlock(&rknpu_obj->export_lock);
+		return ret;
+	}
+
+	if (rknpu_obj->owner || !rknpu_obj->dmabuf)
+		return -ENOMEM;
+
+	mutex_lock(&rknpu_obj->export_lock);
+	if (!rknpu_obj->kv_addr) {
+		ret = dma_buf_vmap_unlocked(rknpu_obj->dmabuf, &map);
+		if (ret) {
+			LOG_ERROR("kmap: dma_buf_vmap failed: %d\n", ret);
+		} else if (map.is_iomem) {
+			struct iosys_map unmap = map;
+
+			dma_buf_vunmap_unlocked(rknpu_obj->dmabuf, &unmap);
+			ret = -EOPNOTSUPP;
+		} else {
+			WRITE_ONCE(rknpu_obj->kv_addr, map.vaddr);
+			spin_lock(&rknpu_dev->lock);
+			rknpu_dev->import_kmaps++;
+			spin_unlock(&rknpu_dev->lock);
+		}
+	}
+	mutex_unlock(&rknpu_obj->export_lock);
+
+	return ret;
+}
+
+/*
+ * Allocate a driver-owned page-array BO that belongs to no session, e.g.
+ * the backing copy of a shared BO. @dir is the NPU's access to it;
+ * DMA_TO_DEVICE maps it read-only in the IOMMU.
+ */
+struct rknpu_mem_object *
+rknpu_mem_obj_create_pages(struct rknpu_device *rknpu_dev, size_t size,
+			   unsigned int flags, enum dma_data_direction dir)
+{
+	struct rknpu_mem_object *rknpu_obj;
+	int ret;
+
+	rknpu_obj = kzalloc(sizeof(*rknpu_obj), GFP_KERNEL_ACCOUNT);
+	if (!rknpu_obj)
+		return ERR_PTR(-ENOMEM);
+
+	rknpu_obj->rknpu_dev = rknpu_dev;
+	kref_init(&rknpu_obj->refcount);
+	mutex_init(&rknpu_obj->export_lock);
+	INIT_LIST_HEAD(&rknpu_obj->attachments);
+	rknpu_obj->size = PAGE_ALIGN(size);
+	rknpu_obj->owner = 1;
+	rknpu_obj->flags = flags | RKNPU_MEM_NON_CONTIGUOUS;
+	rknpu_obj->dma_dir = dir;
+
+	ret = rknpu_mem_alloc_pages(rknpu_dev, rknpu_obj);
+	if (ret) {
+		kfree(rknpu_obj);
+		return ERR_PTR(ret);
+	}
+
+	return rknpu_obj;
+}
+
+/*
+ * Resolve a userspace obj_addr to a BO of this session and take a
+ * reference on it. Returns NULL if the BO does not belong to the session.
+ */
+struct rknpu_mem_object *rknpu_mem_obj_lookup(struct rknpu_device *rknpu_dev,
+					      struct file *file,
+					      __u64 obj_addr)
+{
+	struct rknpu_mem_object *entry, *found = NULL;
+	struct rknpu_session *session;
+
+	spin_lock(&rknpu_dev->lock);
+	session = file->private_data;
+	if (session) {
+		list_for_each_entry(entry, &session->list, head) {
+			if ((__u64)(uintptr_t)entry == obj_addr) {
+				rknpu_mem_obj_get(entry);
+				found = entry;
+				break;
+			}
+		}
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	return found;
+}
+
+static void rknpu_mem_vm_open(struct vm_area_struct *vma)
+{
+	rknpu_mem_obj_get(vma->vm_private_data);
+}
+
+static void rknpu_mem_vm_close(struct vm_area_struct *vma)
+{
+	rknpu_mem_obj_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct rknpu_mem_vm_ops = {
+	.open = rknpu_mem_vm_open,
+	.close = rknpu_mem_vm_close,
+};
+
+/*
+ * Whether BO page @idx at user address @addr starts a PMD-sized block that
+ * can be mapped with one block entry: a 2 MB chunk (they come first in the
+ * BO) at a PMD-aligned address that lies completely inside @vma.
+ */
+static bool rknpu_mem_pmd_block(struct rknpu_mem_object *rknpu_obj,
+				struct vm_area_struct *vma, unsigned long addr,
+				unsigned long idx)
+{
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+	return rknpu_mem_chunk_sizes[0] == PMD_SIZE &&
+	       IS_ALIGNED(addr, PMD_SIZE) && addr >= vma->vm_start &&
+	       addr + PMD_SIZE <= vma->vm_end &&
+	       IS_ALIGNED(idx, PTRS_PER_PMD) &&
+	       idx + PTRS_PER_PMD <= rknpu_obj->nr_chunks[0] * PTRS_PER_PMD;
+#else
+	return false;
+#endif
+}
+
+static vm_fault_t rknpu_mem_vm_fault(struct vm_fault *vmf)
+{
+	struct rknpu_mem_object *rknpu_obj = vmf->vma->vm_private_data;
+
+	if (vmf->pgoff >= rknpu_obj->num_pages)
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vmf->vma, vmf->address,
+			      page_to_pfn(rknpu_obj->pages[vmf->pgoff]));
+}
+
+static vm_fault_t rknpu_mem_vm_huge_fault(struct vm_fault *vmf,
+					  unsigned int order)
+{
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+	struct vm_area_struct *vma = vmf->vma;
+	struct rknpu_mem_object *rknpu_obj = vma->vm_private_data;
+	struct rknpu_device *rknpu_dev = rknpu_obj->rknpu_dev;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long idx = vmf->pgoff - ((vmf->address - addr) >> PAGE_SHIFT);
+	ktime_t start;
+	vm_fault_t ret;
+
+	if (order == PMD_ORDER &&
+	    rknpu_mem_pmd_block(rknpu_obj, vma, addr, idx)) {
+		start = ktime_get();
+		ret = vmf_insert_pfn_pmd(vmf,
+					 page_to_pfn(rknpu_obj->pages[idx]),
+					 vmf->flags & FAULT_FLAG_WRITE);
+		/* The first-touch cost of deferring the blocks */
+		atomic64_inc(&rknpu_dev->pmd_faults);
+		atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+			     &rknpu_dev->pmd_fault_ns);
+		return ret;
+	}
+#endif
+	return VM_FAULT_FALLBACK;
+}
+
+static const struct vm_operations_struct rknpu_mem_pages_vm_ops = {
+	.open = rknpu_mem_vm_open,
+	.close = rknpu_mem_vm_close,
+	.fault = rknpu_mem_vm_fault,
+	.huge_fault = rknpu_mem_vm_huge_fault,
+};
+
+/*
+ * Map a page-array BO by PFN. Every page is mapped up front, one
+ * remap_pfn_range() per physically contiguous run, so no access faults.
+ * With mmap_pmd_blocks set, PMD-sized blocks are left out instead: those
+ * take a single fault on first touch and get a block entry (pages
+ * inserted at mmap time cannot be merged into one later, and no exported
+ * helper installs a PMD outside a fault). The VMA is marked VM_HUGEPAGE
+ * for that, or the THP policy may keep .huge_fault from being called and
+ * every page of the blocks faults on its own; the faults are counted in
+ * debugfs. Private writable mappings need struct page COW semantics and
+ * keep using vm_map_pages().
+ */
+static int rknpu_mem_mmap_pages(struct rknpu_mem_object *rknpu_obj,
+				struct vm_area_struct *vma)
+{
+	bool pmd_blocks = READ_ONCE(mmap_pmd_blocks);
+	unsigned long addr = vma->vm_start;
+	unsigned long idx = vma->vm_pgoff;
+	unsigned long pfn, n;
+	int ret;
+
+	vma->vm_page_prot = rknpu_mem_pgprot(rknpu_obj, vma->vm_page_prot);
+
+	if (is_cow_mapping(vma->vm_flags))
+		return vm_map_pages(vma, rknpu_obj->pages,
+				    rknpu_obj->num_pages);
+
+	if (vma->vm_pgoff + vma_pages(vma) > rknpu_obj->num_pages)
+		return -ENXIO;
+
+	vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+	if (pmd_blocks)
+		vm_flags_set(vma, VM_HUGEPAGE);
+
+	while (addr < vma->vm_end) {
+		if (pmd_blocks &&
+		    rknpu_mem_pmd_block(rknpu_obj, vma, addr, idx)) {
+			addr += PMD_SIZE;
+			idx += PTRS_PER_PMD;
+			continue;
+		}
+
+		pfn = page_to_pfn(rknpu_obj->pages[idx]);
+		for (n = 1; addr + (n << PAGE_SHIFT) < vma->vm_end; n++) {
+			if (page_to_pfn(rknpu_obj->pages[idx + n]) != pfn + n ||
+			    (pmd_blocks &&
+			     rknpu_mem_pmd_block(rknpu_obj, vma,
+						 addr + (n << PAGE_SHIFT),
+						 idx + n)))
+				break;
+		}
+
+		ret = remap_pfn_range(vma, addr, pfn, n << PAGE_SHIFT,
+				      vma->vm_page_prot);
+		if (ret)
+			return ret;
+
+		addr += n << PAGE_SHIFT;
+		idx += n;
+	}
+
+	return 0;
+}
+
+/*
+ * The SRAM head of a BO has no struct page, so the whole BO is mapped by
+ * PFN.
+ */
+static int rknpu_mem_mmap_sram(struct rknpu_mem_object *rknpu_obj,
+			       struct vm_area_struct *vma)
+{
+	unsigned long sram_pages = rknpu_obj->sram_size >> PAGE_SHIFT;
+	unsigned long end = vma->vm_pgoff + vma_pages(vma);
+	pgprot_t prot = rknpu_mem_pgprot(rknpu_obj, vma->vm_page_prot);
+	unsigned long addr = vma->vm_start;
+	unsigned long i = vma->vm_pgoff;
+	unsigned long n;
+	int ret;
+
+	if (end > rknpu_obj->num_pages)
+		return -EINVAL;
+
+	if (i < sram_pages) {
+		n = min(end, sram_pages) - i;
+		ret = remap_pfn_range(vma, addr,
+				      PHYS_PFN(rknpu_obj->sram_phys) + i,
+				      n << PAGE_SHIFT,
+				      pgprot_writecombine(vma->vm_page_prot));
+		if (ret)
+			return ret;
+		addr += n << PAGE_SHIFT;
+		i += n;
+	}
+
+	for (; i < end; i++, addr += PAGE_SIZE) {
+		ret = remap_pfn_range(vma, addr,
+				      page_to_pfn(rknpu_obj->pages[i]),
+				      PAGE_SIZE, prot);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Register @rknpu_obj in @session: imports keep their fd (@handle) as
+ * handle, a newer import of the same fd number wins; driver BOs get a
+ * fresh handle. Every BO gets a fake mmap offset range of its own size.
  */
+static int rknpu_mem_session_add(struct rknpu_session *session,
+				 struct rknpu_mem_object *rknpu_obj,
+				 u32 handle)
+{
+	unsigned long pgoff;
+	void *old;
+	int ret;
 
-#include <linux/slab.h>
-#include <linux/dma-mapping.h>
-#include <linux/dma-buf.h>
-#include <linux/iosys-map.h>
-#include <linux/uaccess.h>
+	mutex_lock(&session->mm_lock);
 
-#include "rknpu_drv.h"
-#include "rknpu_ioctl.h"
-#include "rknpu_mem.h"
+	ret = mtree_alloc_range(&session->mmap_offsets, &pgoff, rknpu_obj,
+				PAGE_ALIGN(rknpu_obj->size) >> PAGE_SHIFT,
+				RKNPU_MEM_MMAP_PGOFF_MIN,
+				RKNPU_MEM_MMAP_PGOFF_MAX, GFP_KERNEL);
+	if (ret)
+		goto out_unlock;
+	rknpu_obj->mmap_pgoff = pgoff;
+
+	if (handle) {
+		old = xa_store(&session->handles, handle, rknpu_obj,
+			       GFP_KERNEL);
+		ret = xa_err(old);
+	} else {
+		ret = xa_alloc_cyclic(&session->handles, &handle, rknpu_obj,
+				      XA_LIMIT(RKNPU_MEM_HANDLE_MIN, U32_MAX),
+				      &session->next_handle, GFP_KERNEL);
+		if (ret > 0)
+			ret = 0;
+	}
+	if (ret) {
+		mtree_erase(&session->mmap_offsets, pgoff);
+		goto out_unlock;
+	}
+	rknpu_obj->handle = handle;
+
+out_unlock:
+	mutex_unlock(&session->mm_lock);
+	return ret;
+}
+
+static void rknpu_mem_session_remove(struct rknpu_session *session,
+				     struct rknpu_mem_object *rknpu_obj)
+{
+	mutex_lock(&session->mm_lock);
+	mtree_erase(&session->mmap_offsets, rknpu_obj->mmap_pgoff);
+	/* The handle may already belong to a newer import of the same fd */
+	xa_cmpxchg(&session->handles, rknpu_obj->handle, rknpu_obj, NULL, 0);
+	mutex_unlock(&session->mm_lock);
+}
+
+/* Resolve a MEM_MAP handle and take a reference on the BO */
+struct rknpu_mem_object *
+rknpu_mem_obj_lookup_handle(struct rknpu_session *session, u32 handle)
+{
+	struct rknpu_mem_object *rknpu_obj;
+
+	mutex_lock(&session->mm_lock);
+	rknpu_obj = xa_load(&session->handles, handle);
+	if (rknpu_obj)
+		rknpu_mem_obj_get(rknpu_obj);
+	mutex_unlock(&session->mm_lock);
+
+	return rknpu_obj;
+}
+
+/* Resolve a fake mmap offset and take a reference on the BO */
+struct rknpu_mem_object *
+rknpu_mem_obj_lookup_pgoff(struct rknpu_session *session, unsigned long pgoff)
+{
+	struct rknpu_mem_object *rknpu_obj;
+
+	mutex_lock(&session->mm_lock);
+	rknpu_obj = mtree_load(&session->mmap_offsets, pgoff);
+	if (rknpu_obj)
+		rknpu_mem_obj_get(rknpu_obj);
+	mutex_unlock(&session->mm_lock);
+
+	return rknpu_obj;
+}
+
+int rknpu_mem_mmap_obj(struct rknpu_device *rknpu_dev,
+		       struct rknpu_mem_object *rknpu_obj,
+		       struct vm_area_struct *vma)
+{
+	int ret;
+
+	/* Imports are mapped by their exporter; the dma-buf file pins them */
+	if (!rknpu_obj->owner)
+		return dma_buf_mmap(rknpu_obj->dmabuf, vma, vma->vm_pgoff);
+
+	/*
+	 * Userptr memory is already mapped by its owner; views need not be
+	 * page aligned and are reached through their parent's mapping.
+	 */
+	if ((rknpu_obj->flags & RKNPU_MEM_USERPTR) || rknpu_obj->parent)
+		return -EINVAL;
+
+	/* The caller's reference keeps it resident, then the mapping's */
+	if (rknpu_obj->flags & RKNPU_MEM_EVICTABLE) {
+		ret = rknpu_mem_evict_restore(rknpu_obj);
+		if (ret)
+			return ret;
+	}
+
+	/* Shared constant BOs are mapped read-only into every session */
+	if (rknpu_obj->shared) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vm_flags_clear(vma, VM_MAYWRITE);
+	}
+
+	if (rknpu_obj->sram_size) {
+		ret = rknpu_mem_mmap_sram(rknpu_obj, vma);
+	} else if (rknpu_obj->pages) {
+		ret = rknpu_mem_mmap_pages(rknpu_obj, vma);
+	} else if (rknpu_obj->carveout) {
+		ret = dma_mmap_attrs(rknpu_dev->dev, vma, rknpu_obj->kv_addr,
+				     rknpu_obj->dma_addr, rknpu_obj->size,
+				     DMA_ATTR_FORCE_CONTIGUOUS);
+	} else {
+		/*
+		 * dma_alloc_coherent memory can be mapped to userspace via
+		 * dma_mmap_coherent which handles the pfn translation
+		 * correctly for both IOMMU and non-IOMMU cases. It maps
+		 * the whole buffer up front as well.
+		 */
+		ret = dma_mmap_coherent(rknpu_dev->dev, vma,
+					rknpu_obj->kv_addr,
+					rknpu_obj->dma_addr, rknpu_obj->size);
+	}
+	if (ret)
+		return ret;
+
+	/*
+	 * The mapping keeps the BO alive: PFN mappings hold no page
+	 * references, and a freed coherent BO would be recycled by the pool.
+	 */
+	rknpu_mem_obj_get(rknpu_obj);
+	vma->vm_private_data = rknpu_obj;
+	if (vma->vm_flags & VM_PFNMAP && rknpu_obj->pages &&
+	    !rknpu_obj->sram_size)
+		vma->vm_ops = &rknpu_mem_pages_vm_ops;
+	else
+		vma->vm_ops = &rknpu_mem_vm_ops;
+
+	return 0;
+}
+
+/* Back a driver-owned BO of rknpu_obj->size bytes with memory */
+static int rknpu_mem_alloc_backing(struct rknpu_device *rknpu_dev,
+				   struct rknpu_mem_object *rknpu_obj,
+				   __u64 obj_addr)
+{
+	if (rknpu_obj->flags & RKNPU_MEM_USERPTR)
+		return rknpu_mem_get_userptr(rknpu_dev, rknpu_obj, obj_addr);
+
+	if (rknpu_obj->flags & RKNPU_MEM_NON_CONTIGUOUS)
+		return rknpu_mem_alloc_pages(rknpu_dev, rknpu_obj);
+
+	if (rknpu_mem_pool_get(rknpu_dev, rknpu_obj, rknpu_obj->size) ||
+	    !rknpu_carveout_alloc(rknpu_dev, rknpu_obj))
+		return 0;
+
+	/* dma_alloc_coherent() always returns zeroed memory */
+	rknpu_obj->kv_addr = dma_alloc_coherent(rknpu_dev->dev, rknpu_obj->size,
+						&rknpu_obj->dma_addr,
+						GFP_KERNEL_ACCOUNT);
+	if (!rknpu_obj->kv_addr) {
+		LOG_ERROR("mem_create: dma_alloc_coherent failed for size %lu\n",
+			  rknpu_obj->size);
+		return -ENOMEM;
+	}
 
-static atomic_t handle_counter = ATOMIC_INIT(0);
+	return 0;
+}
 
 int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			   unsigned int cmd, unsigned long data)
 {
 	struct rknpu_mem_create args;
 	struct rknpu_mem_object *rknpu_obj = NULL;
-	struct rknpu_session *session = NULL;
+	struct rknpu_session *session = file->private_data;
 	unsigned int in_size = _IOC_SIZE(cmd);
 	unsigned int k_size = sizeof(struct rknpu_mem_create);
 	int ret;
@@ -48,10 +1125,18 @@ int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 		return -EFAULT;
 	}
 
-	rknpu_obj = kzalloc(sizeof(*rknpu_obj), GFP_KERNEL);
+	if (!session)
+		return -EFAULT;
+
+	rknpu_obj = kzalloc(sizeof(*rknpu_obj), GFP_KERNEL_ACCOUNT);
 	if (!rknpu_obj)
 		return -ENOMEM;
 
+	rknpu_obj->rknpu_dev = rknpu_dev;
+	kref_init(&rknpu_obj->refcount);
+	mutex_init(&rknpu_obj->export_lock);
+	INIT_LIST_HEAD(&rknpu_obj->attachments);
+
 	if (args.handle > 0) {
 		/*
 		 * Path A: Import DMA-BUF fd from userspace (SDK path).
@@ -60,10 +1145,12 @@ int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 		 * and passes the DMA-BUF fd in the handle field.
 		 */
 		int fd = args.handle;
+		struct rknpu_mem_object *cached;
 		struct dma_buf *dmabuf;
 		struct dma_buf_attachment *attachment;
 		struct sg_table *sgt;
 		struct scatterlist *sgl;
+		ktime_t start = ktime_get();
 
 		dmabuf = dma_buf_get(fd);
 		if (IS_ERR(dmabuf)) {
@@ -72,6 +1159,27 @@ int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			ret = PTR_ERR(dmabuf);
 			goto err_free_obj;
 		}
+		rknpu_obj->dmabuf = dmabuf;
+
+		/* Recurring camera/decoder buffers: reuse the last mapping */
+		cached = rknpu_mem_import_cache_take(session, dmabuf,
+						     PAGE_ALIGN(args.size));
+		if (cached) {
+			/* The cached BO holds its own dma-buf reference */
+			dma_buf_put(dmabuf);
+			kfree(rknpu_obj);
+			rknpu_obj = cached;
+
+			args.handle = fd;
+			args.size = rknpu_obj->size;
+			args.obj_addr = (__u64)(uintptr_t)rknpu_obj;
+			args.dma_addr = (__u64)rknpu_obj->dma_addr;
+			args.sram_size = 0;
+
+			rknpu_mem_import_stat(rknpu_dev,
+					      ktime_sub(ktime_get(), start));
+			goto add_session;
+		}
 
 		attachment = dma_buf_attach(dmabuf, rknpu_dev->dev);
 		if (IS_ERR(attachment)) {
@@ -80,6 +1188,7 @@ int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			ret = PTR_ERR(attachment);
 			goto err_put_dmabuf;
 		}
+		rknpu_obj->attachment = attachment;
 
 		sgt = dma_buf_map_attachment(attachment, DMA_BIDIRECTIONAL);
 		if (IS_ERR(sgt)) {
@@ -90,33 +1199,11 @@ int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 		}
 
 		sgl = sgt->sgl;
-		rknpu_obj->dmabuf = dmabuf;
-		rknpu_obj->attachment = attachment;
-		rknpu_obj->sgt = sgt;
-		rknpu_obj->dma_addr = sg_dma_address(sgl);
-		rknpu_obj->size = PAGE_ALIGN(args.size);
-		rknpu_obj->owner = 0; /* imported, not owned */
 
 		/*
-		 * Kernel virtual mapping needed so SUBMIT handler can read
-		 * task descriptors from the BO.
+		 * The NPU gets one base address, so the exporter's mapping
+		 * must be one IOVA range covering the requested size.
 		 */
-		{
-			struct iosys_map map;
-			ret = dma_buf_vmap(dmabuf, &map);
-			if (ret) {
-				LOG_ERROR("mem_create: dma_buf_vmap failed: %d\n", ret);
-				goto err_unmap_attachment;
-			}
-			rknpu_obj->kv_addr = map.vaddr;
-		}
-
-		args.handle = fd; /* return same fd */
-		args.size = rknpu_obj->size;
-		args.obj_addr = (__u64)(uintptr_t)rknpu_obj;
-		args.dma_addr = (__u64)rknpu_obj->dma_addr;
-		args.sram_size = 0;
-
 		{
 			struct scatterlist *sg_iter;
 			int sg_idx;
@@ -125,92 +1212,155 @@ int rknpu_mem_create_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 			for_each_sgtable_dma_sg(sgt, sg_iter, sg_idx) {
 				dma_addr_t a = sg_dma_address(sg_iter);
 				unsigned int l = sg_dma_len(sg_iter);
+
+				LOG_DEBUG("mem_create: IMPORT fd=%d sg[%d] dma=%#llx len=%u\n",
+					  fd, sg_idx, (u64)a, l);
+				if (a != sg_dma_address(sgl) + total_dma_len)
+					break;
 				total_dma_len += l;
-				LOG_INFO("mem_create: IMPORT fd=%d sg[%d] dma=%#llx len=%u\n",
-					 fd, sg_idx, (u64)a, l);
 			}
-			LOG_INFO("mem_create: IMPORT fd=%d total_dma_len=%llu requested=%llu dma_base=%#llx nents=%d orig_nents=%d\n",
-				 fd, (u64)total_dma_len, args.size,
-				 args.dma_addr, sgt->nents,
-				 sgt->orig_nents);
+			LOG_DEBUG("mem_create: IMPORT fd=%d total_dma_len=%llu requested=%llu dma_base=%#llx nents=%d orig_nents=%d\n",
+				  fd, (u64)total_dma_len, args.size,
+				  (u64)sg_dma_address(sgl), sgt->nents,
+				  sgt->orig_nents);
+
+			if (!args.size || sg_idx != sgt->nents ||
+			    total_dma_len < PAGE_ALIGN(args.size)) {
+				LOG_ERROR("mem_create: fd=%d not IOVA contiguous for %llu bytes (%d of %u segments, %llu bytes)\n",
+					  fd, args.size, sg_idx, sgt->nents,
+					  (u64)total_dma_len);
+				dma_buf_unmap_attachment(attachment, sgt,
+							 DMA_BIDIRECTIONAL);
+				ret = -EINVAL;
+				goto err_detach;
+			}
 		}
+
+		rknpu_obj->sgt = sgt;
+		rknpu_obj->dma_addr = sg_dma_address(sgl);
+		rknpu_obj->size = PAGE_ALIGN(args.size);
+		rknpu_obj->owner = 0; /* imported, not owned */
+
+		/*
+		 * No kernel mapping here: only the task BO needs one, and
+		 * rknpu_mem_kmap() creates it when SUBMIT first uses it.
+		 */
+
+		args.handle = fd; /* return same fd */
+		args.size = rknpu_obj->size;
+		args.obj_addr = (__u64)(uintptr_t)rknpu_obj;
+		args.dma_addr = (__u64)rknpu_obj->dma_addr;
+		args.sram_size = 0;
+
+		rknpu_mem_import_stat(rknpu_dev, ktime_sub(ktime_get(), start));
 	} else {
 		/*
 		 * Path B: Kernel allocates via dma_alloc_coherent (NIF path).
 		 *
-		 * Returns a counter as handle (not an fd). Userspace mmaps
+		 * Returns a session handle (not an fd). Userspace mmaps
 		 * via /dev/rknpu using the MEM_MAP ioctl to get the offset.
 		 */
-		void *kv_addr;
-		dma_addr_t dma_addr;
 		size_t aligned_size = PAGE_ALIGN(args.size);
 
-		kv_addr = dma_alloc_coherent(rknpu_dev->dev, aligned_size,
-					     &dma_addr,
-					     GFP_KERNEL | __GFP_ZERO);
-		if (!kv_addr) {
-			LOG_ERROR("mem_create: dma_alloc_coherent failed for size %zu\n",
-				  aligned_size);
-			ret = -ENOMEM;
+		if (!aligned_size) {
+			ret = -EINVAL;
 			goto err_free_obj;
 		}
 
-		rknpu_obj->kv_addr = kv_addr;
-		rknpu_obj->dma_addr = dma_addr;
 		rknpu_obj->size = aligned_size;
 		rknpu_obj->owner = 1; /* driver owns this allocation */
-		rknpu_obj->dmabuf = NULL;
-		rknpu_obj->attachment = NULL;
-		rknpu_obj->sgt = NULL;
+		rknpu_obj->flags = args.flags;
 
-		args.size = aligned_size;
-		args.obj_addr = (__u64)(uintptr_t)rknpu_obj;
-		args.dma_addr = (__u64)dma_addr;
-		args.handle = atomic_inc_return(&handle_counter);
-		args.sram_size = 0;
+		/*
+		 * Evictable BOs are page arrays behind the IOMMU that can give
+		 * their pages back; they never take SRAM.
+		 */
+		if ((args.flags & RKNPU_MEM_EVICTABLE) &&
+		    (!rknpu_dev->mem_evict || (args.flags & RKNPU_MEM_USERPTR)))
+			rknpu_obj->flags &= ~RKNPU_MEM_EVICTABLE;
+		if (rknpu_obj->flags & RKNPU_MEM_EVICTABLE)
+			rknpu_obj->flags |= RKNPU_MEM_NON_CONTIGUOUS;
+
+		if ((args.flags & RKNPU_MEM_NON_CONTIGUOUS) &&
+		    !rknpu_dev->iommu_en) {
+			LOG_DEBUG("mem_create: no iommu, NON_CONTIGUOUS falls back to contiguous\n");
+			rknpu_obj->flags &= ~RKNPU_MEM_NON_CONTIGUOUS;
+		}
+
+		/*
+		 * Place as much of the buffer as fits in SRAM, the rest in
+		 * DDR. The SRAM head is stitched into a page-array IOVA range.
+		 */
+		if ((args.flags & RKNPU_MEM_TRY_ALLOC_SRAM) &&
+		    !(rknpu_obj->flags &
+		      (RKNPU_MEM_USERPTR | RKNPU_MEM_EVICTABLE))) {
+			rknpu_obj->sram_size =
+				rknpu_sram_alloc(rknpu_dev, aligned_size,
+						 &rknpu_obj->sram_phys);
+			if (rknpu_obj->sram_size)
+				rknpu_obj->flags |= RKNPU_MEM_NON_CONTIGUOUS;
+		}
+
+		ret = rknpu_mem_alloc_backing(rknpu_dev, rknpu_obj,
+					      args.obj_addr);
+		/*
+		 * Destroyed BOs may still hold their memory in the async
+		 * free queue; wait for it once before giving up.
+		 */
+		if (ret == -ENOMEM &&
+		    atomic_long_read(&rknpu_dev->free_pending_bytes)) {
+			rknpu_mem_flush_free(rknpu_dev);
+			ret = rknpu_mem_alloc_backing(rknpu_dev, rknpu_obj,
+						      args.obj_addr);
+		}
+		if (ret) {
+			if (rknpu_obj->sram_size)
+				rknpu_sram_free(rknpu_dev, rknpu_obj->sram_phys,
+						rknpu_obj->sram_size);
+			goto err_free_obj;
+		}
+
+		if (rknpu_obj->flags & RKNPU_MEM_EVICTABLE)
+			rknpu_mem_evict_add(rknpu_obj);
 
-		LOG_DEBUG("mem_create: ALLOC handle=%u size=%llu dma=%#llx\n",
-			  args.handle, args.size, args.dma_addr);
+		args.size = rknpu_obj->size;
+		args.flags = rknpu_obj->flags;
+		args.obj_addr = (__u64)(uintptr_t)rknpu_obj;
+		args.dma_addr = (__u64)rknpu_obj->dma_addr;
+		args.handle = 0; /* allocated by rknpu_mem_session_add() */
+		args.sram_size = rknpu_obj->sram_size;
 	}
 
+add_session:
+	ret = rknpu_mem_session_add(session, rknpu_obj, args.handle);
+	if (ret)
+		goto err_free_alloc;
+	args.handle = rknpu_obj->handle;
+
+	LOG_DEBUG("mem_create: handle=%u size=%llu dma=%#llx flags=%#x mmap_offset=%#llx\n",
+		  args.handle, args.size, args.dma_addr, args.flags,
+		  (u64)rknpu_obj->mmap_pgoff << PAGE_SHIFT);
+
 	if (unlikely(copy_to_user((struct rknpu_mem_create __user *)data, &args,
 				  in_size))) {
 		LOG_ERROR("%s: copy_to_user failed\n", __func__);
+		rknpu_mem_session_remove(session, rknpu_obj);
 		ret = -EFAULT;
 		goto err_free_alloc;
 	}
 
 	/* Track allocation in session for cleanup on fd close */
 	spin_lock(&rknpu_dev->lock);
-	session = file->private_data;
-	if (!session) {
-		spin_unlock(&rknpu_dev->lock);
-		ret = -EFAULT;
-		goto err_free_alloc;
-	}
 	list_add_tail(&rknpu_obj->head, &session->list);
+	rknpu_mem_session_account(session, rknpu_obj, 1);
 	spin_unlock(&rknpu_dev->lock);
 
 	return 0;
 
 err_free_alloc:
-	if (rknpu_obj->owner) {
-		dma_free_coherent(rknpu_dev->dev, rknpu_obj->size,
-				  rknpu_obj->kv_addr, rknpu_obj->dma_addr);
-	} else if (rknpu_obj->sgt) {
-		struct iosys_map unmap = IOSYS_MAP_INIT_VADDR(rknpu_obj->kv_addr);
-		if (rknpu_obj->kv_addr)
-			dma_buf_vunmap(rknpu_obj->dmabuf, &unmap);
-		dma_buf_unmap_attachment(rknpu_obj->attachment,
-					rknpu_obj->sgt, DMA_BIDIRECTIONAL);
-		dma_buf_detach(rknpu_obj->dmabuf, rknpu_obj->attachment);
-		dma_buf_put(rknpu_obj->dmabuf);
-	}
-	goto err_free_obj;
-
-err_unmap_attachment:
-	dma_buf_unmap_attachment(rknpu_obj->attachment,
-				rknpu_obj->sgt, DMA_BIDIRECTIONAL);
+	rknpu_mem_obj_put(rknpu_obj);
+	return ret;
+
 err_detach:
 	dma_buf_detach(rknpu_obj->dmabuf, rknpu_obj->attachment);
 err_put_dmabuf:
@@ -254,6 +1404,7 @@ int rknpu_mem_destroy_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 	list_for_each_entry_safe(entry, q, &session->list, head) {
 		if (entry == rknpu_obj) {
 			list_del(&entry->head);
+			rknpu_mem_session_account(session, entry, -1);
 			found = true;
 			break;
 		}
@@ -261,38 +1412,88 @@ int rknpu_mem_destroy_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
 	spin_unlock(&rknpu_dev->lock);
 
 	if (found) {
-		if (rknpu_obj->owner) {
-			/* Path B: dma_alloc_coherent */
-			dma_free_coherent(rknpu_dev->dev, rknpu_obj->size,
-					  rknpu_obj->kv_addr,
-					  rknpu_obj->dma_addr);
-		} else {
-			/* Path A: imported DMA-BUF */
-			if (rknpu_obj->kv_addr && rknpu_obj->dmabuf) {
-				struct iosys_map unmap =
-					IOSYS_MAP_INIT_VADDR(rknpu_obj->kv_addr);
-				dma_buf_vunmap(rknpu_obj->dmabuf, &unmap);
-			}
-			if (rknpu_obj->sgt && rknpu_obj->attachment)
-				dma_buf_unmap_attachment(rknpu_obj->attachment,
-							 rknpu_obj->sgt,
-							 DMA_BIDIRECTIONAL);
-			if (rknpu_obj->attachment && rknpu_obj->dmabuf)
-				dma_buf_detach(rknpu_obj->dmabuf,
-					       rknpu_obj->attachment);
-			if (rknpu_obj->dmabuf)
-				dma_buf_put(rknpu_obj->dmabuf);
+		rknpu_mem_session_remove(session, rknpu_obj);
+		if (!rknpu_obj->owner && rknpu_obj->dmabuf)
+			rknpu_mem_import_cache_put(session, rknpu_obj);
+		else
+			rknpu_mem_obj_put(rknpu_obj);
+	}
+
+	return 0;
+}
+
+/*
+ * Do the cache maintenance of a view on its own range of the parent.
+ * The parent's table is trimmed to the CPU segments overlapping
+ * [offset, offset + size): its DMA side is a single IOVA range (or the
+ * exporter's layout for imports) and does not describe the pages behind
+ * the view.
+ */
+static int rknpu_mem_sync_view(struct rknpu_device *rknpu_dev,
+			       struct rknpu_mem_object *obj, unsigned int flags)
+{
+	struct sg_table *src = obj->parent->sgt;
+	unsigned long start = obj->offset, end = obj->offset + obj->size;
+	/* A 1:1 mapping (no IOMMU merging) keeps per-entry DMA addresses */
+	bool dma_1to1 = src->nents == src->orig_nents;
+	struct scatterlist *sg, *dst;
+	unsigned long pos = 0;
+	unsigned int nents = 0;
+	struct sg_table sgt;
+	int i, ret;
+
+	for_each_sgtable_sg(src, sg, i) {
+		if (pos < end && pos + sg->length > start)
+			nents++;
+		pos += sg->length;
+	}
+	if (!nents)
+		return 0;
+
+	ret = sg_alloc_table(&sgt, nents, GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	pos = 0;
+	dst = sgt.sgl;
+	for_each_sgtable_sg(src, sg, i) {
+		unsigned long skip, len;
+
+		if (pos >= end)
+			break;
+		if (pos + sg->length <= start) {
+			pos += sg->length;
+			continue;
 		}
-		kfree(rknpu_obj);
+
+		skip = start > pos ? start - pos : 0;
+		len = min_t(unsigned long, sg->length - skip, end - pos - skip);
+		sg_set_page(dst, sg_page(sg), len, sg->offset + skip);
+		if (dma_1to1) {
+			sg_dma_address(dst) = sg_dma_address(sg) + skip;
+			sg_dma_len(dst) = len;
+		}
+		dst = sg_next(dst);
+		pos += sg->length;
 	}
 
+	if (flags & RKNPU_MEM_SYNC_TO_DEVICE)
+		dma_sync_sg_for_device(rknpu_dev->dev, sgt.sgl, nents,
+				       DMA_TO_DEVICE);
+	if (flags & RKNPU_MEM_SYNC_FROM_DEVICE)
+		dma_sync_sg_for_cpu(rknpu_dev->dev, sgt.sgl, nents,
+				    DMA_FROM_DEVICE);
+
+	sg_free_table(&sgt);
 	return 0;
 }
 
-int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, unsigned long data)
+int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			 unsigned long data)
 {
 	struct rknpu_mem_sync args;
 	struct rknpu_mem_object *obj;
+	int ret = 0;
 
 	if (unlikely(copy_from_user(&args, (struct rknpu_mem_sync __user *)data,
 				    sizeof(args)))) {
@@ -300,13 +1501,32 @@ int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, unsigned long data)
 		return -EFAULT;
 	}
 
-	obj = (struct rknpu_mem_object *)(uintptr_t)args.obj_addr;
-	if (!obj)
+	obj = rknpu_mem_obj_lookup(rknpu_dev, file, args.obj_addr);
+	if (!obj) {
+		LOG_ERROR("mem_sync: invalid obj_addr %#llx\n", args.obj_addr);
 		return -EINVAL;
+	}
+
+	/* Shared BOs are mapped DMA_TO_DEVICE, the NPU cannot write them */
+	if (obj->shared || (obj->parent && obj->parent->shared))
+		args.flags &= ~RKNPU_MEM_SYNC_FROM_DEVICE;
+
+	/* A view only syncs its own range of the parent's mapping */
+	if (obj->parent) {
+		struct rknpu_mem_object *parent = obj->parent;
+
+		if (parent->sgt &&
+		    (!parent->owner || (parent->flags & RKNPU_MEM_CACHEABLE)))
+			ret = rknpu_mem_sync_view(rknpu_dev, obj, args.flags);
+		rknpu_mem_obj_put(obj);
+		return ret;
+	}
 
 	/*
 	 * For dma_alloc_coherent memory (owner=1): no sync needed
-	 * (cache-coherent by definition).
+	 * (cache-coherent by definition). The same holds for page-array
+	 * BOs unless they were created RKNPU_MEM_CACHEABLE, since their
+	 * CPU mappings are write-combined otherwise.
 	 *
 	 * For imported DMA-BUFs (owner=0): must flush CPU caches to
 	 * make writes visible to the NPU via DMA. The SDK calls this
@@ -316,7 +1536,11 @@ int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, unsigned long data)
 	 * directly. Here we use dma_sync_sgtable which works on the
 	 * DMA-BUF attachment's scatter-gather table.
 	 */
-	if (!obj->owner && obj->sgt) {
+	/* The evictor rewrites the table's pages under this lock */
+	if (obj->flags & RKNPU_MEM_EVICTABLE)
+		mutex_lock(&rknpu_dev->mem_evict->lock);
+
+	if (obj->sgt && (!obj->owner || (obj->flags & RKNPU_MEM_CACHEABLE))) {
 		if (args.flags & RKNPU_MEM_SYNC_TO_DEVICE) {
 			dma_sync_sgtable_for_device(rknpu_dev->dev,
 						    obj->sgt, DMA_TO_DEVICE);
@@ -331,5 +1555,203 @@ int rknpu_mem_sync_ioctl(struct rknpu_device *rknpu_dev, unsigned long data)
 		}
 	}
 
+	if (obj->flags & RKNPU_MEM_EVICTABLE)
+		mutex_unlock(&rknpu_dev->mem_evict->lock);
+
+	rknpu_mem_obj_put(obj);
+
+	return 0;
+}
+
+/*
+ * Create a BO for @size bytes at @offset of an existing BO, so one pooled
+ * buffer (one import) can hold all of a model's I/O tensors. The view
+ * pins its parent and has its own handle, NPU address and kernel address
+ * but no memory or CPU mapping of its own; views of views refer to the
+ * underlying BO directly.
+ */
+int rknpu_mem_view_ioctl(struct rknpu_device *rknpu_dev, struct file *file,
+			 unsigned long data)
+{
+	struct rknpu_session *session = file->private_data;
+	struct rknpu_mem_object *parent, *rknpu_obj;
+	struct rknpu_mem_view args;
+	unsigned long offset;
+	int ret;
+
+	if (unlikely(copy_from_user(&args, (struct rknpu_mem_view __user *)data,
+				    sizeof(args)))) {
+		LOG_ERROR("%s: copy_from_user failed\n", __func__);
+		return -EFAULT;
+	}
+
+	if (!session || args.reserved)
+		return -EINVAL;
+
+	parent = rknpu_mem_obj_lookup(rknpu_dev, file, args.obj_addr);
+	if (!parent) {
+		LOG_ERROR("view: invalid obj_addr %#llx\n", args.obj_addr);
+		return -EINVAL;
+	}
+
+	if (!args.size || args.offset >= parent->size ||
+	    args.size > parent->size - args.offset) {
+		ret = -EINVAL;
+		goto err_put_parent;
+	}
+
+	offset = args.offset;
+	if (parent->parent) {
+		offset += parent->offset;
+		rknpu_mem_obj_get(parent->parent);
+		rknpu_mem_obj_put(parent);
+		parent = parent->parent;
+	}
+
+	/* The view's reference keeps an evictable parent resident */
+	if (parent->flags & RKNPU_MEM_EVICTABLE) {
+		ret = rknpu_mem_evict_restore(parent);
+		if (ret)
+			goto err_put_parent;
+	}
+
+	rknpu_obj = kzalloc(sizeof(*rknpu_obj), GFP_KERNEL_ACCOUNT);
+	if (!rknpu_obj) {
+		ret = -ENOMEM;
+		goto err_put_parent;
+	}
+
+	rknpu_obj->rknpu_dev = rknpu_dev;
+	kref_init(&rknpu_obj->refcount);
+	mutex_init(&rknpu_obj->export_lock);
+	INIT_LIST_HEAD(&rknpu_obj->attachments);
+	rknpu_obj->parent = parent;
+	rknpu_obj->offset = offset;
+	rknpu_obj->size = args.size;
+	rknpu_obj->owner = parent->owner;
+	rknpu_obj->flags = parent->flags;
+	rknpu_obj->dma_addr = parent->dma_addr + offset;
+
+	ret = rknpu_mem_session_add(session, rknpu_obj, 0);
+	if (ret)
+		goto err_put_obj;
+
+	args.view_obj_addr = (__u64)(uintptr_t)rknpu_obj;
+	args.dma_addr = (__u64)rknpu_obj->dma_addr;
+	args.handle = rknpu_obj->handle;
+
+	LOG_DEBUG("view: parent=%p offset=%lu size=%llu dma=%#llx handle=%u\n",
+		  parent, offset, args.size, args.dma_addr, args.handle);
+
+	if (unlikely(copy_to_user((struct rknpu_mem_view __user *)data, &args,
+				  sizeof(args)))) {
+		LOG_ERROR("%s: copy_to_user failed\n", __func__);
+		rknpu_mem_session_remove(session, rknpu_obj);
+		ret = -EFAULT;
+		goto err_put_obj;
+	}
+
+	spin_lock(&rknpu_dev->lock);
+	list_add_tail(&rknpu_obj->head, &session->list);
+	rknpu_mem_session_account(session, rknpu_obj, 1);
+	spin_unlock(&rknpu_dev->lock);
+
+	return 0;
+
+err_put_obj:
+	/* Drops the parent reference too */
+	rknpu_mem_obj_put(rknpu_obj);
+	return ret;
+
+err_put_parent:
+	rknpu_mem_obj_put(parent);
+	return ret;
+}
+
+/*
+ * debugfs: list every BO with its physical chunk layout. The IOMMU core
+ * maps each chunk with the largest page size in the domain's pgsize_bitmap
+ * that fits, so the chunk histogram is the mapping granularity achieved.
+ */
+int rknpu_mem_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct iommu_domain *domain = NULL;
+	struct rknpu_session *session;
+	struct rknpu_mem_object *entry;
+	int c;
+
+	if (!rknpu_dev)
+		return -ENODEV;
+
+	if (rknpu_dev->iommu_en)
+		domain = iommu_get_domain_for_dev(rknpu_dev->dev);
+	seq_printf(s, "# iommu pgsize_bitmap=%#lx\n",
+		   domain ? domain->pgsize_bitmap : 0UL);
+
+	spin_lock(&rknpu_dev->lock);
+	seq_printf(s, "# imports=%llu avg_us=%llu max_us=%llu lazy_kmaps=%llu cache_hits=%llu\n",
+		   rknpu_dev->import_count,
+		   rknpu_dev->import_count ?
+			   div64_u64(rknpu_dev->import_ns,
+				     rknpu_dev->import_count * NSEC_PER_USEC) : 0,
+		   (u64)rknpu_dev->import_ns_max / NSEC_PER_USEC,
+		   rknpu_dev->import_kmaps, rknpu_dev->import_cache_hits);
+	spin_unlock(&rknpu_dev->lock);
+	seq_printf(s, "# pmd_faults=%lld pmd_fault_avg_ns=%llu\n",
+		   atomic64_read(&rknpu_dev->pmd_faults),
+		   div64_u64(atomic64_read(&rknpu_dev->pmd_fault_ns),
+			     max_t(u64, atomic64_read(&rknpu_dev->pmd_faults),
+				   1)));
+	seq_printf(s, "# deferred_frees=%lld pending=%ld pending_bytes=%ld\n",
+		   atomic64_read(&rknpu_dev->free_deferred),
+		   atomic_long_read(&rknpu_dev->free_pending),
+		   atomic_long_read(&rknpu_dev->free_pending_bytes));
+
+	seq_puts(s, "# session obj dma_addr size sram_size flags owner chunks(2M/64K/4K)\n");
+
+	spin_lock(&rknpu_dev->lock);
+	list_for_each_entry(session, &rknpu_dev->sessions, head) {
+		list_for_each_entry(entry, &session->list, head) {
+			seq_printf(s, "%p %p %#llx %lu %zu %#x %d",
+				   session, entry, (u64)entry->dma_addr,
+				   entry->size, entry->sram_size, entry->flags,
+				   entry->owner);
+			for (c = 0; c < RKNPU_MEM_NR_CHUNK_SIZES; c++)
+				seq_printf(s, "%c%lu", c ? '/' : ' ',
+					   entry->nr_chunks[c]);
+			seq_putc(s, '\n');
+		}
+	}
+	spin_unlock(&rknpu_dev->lock);
+
+	return 0;
+}
+
+int rknpu_mem_sessions_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct rknpu_session *session;
+	u64 total;
+	int i;
+
+	if (!rknpu_dev)
+		return -ENODEV;
+
+	seq_puts(s, "# pid comm bos cached coherent pages import sram shared userptr total\n");
+
+	spin_lock(&rknpu_dev->lock);
+	list_for_each_entry(session, &rknpu_dev->sessions, head) {
+		seq_printf(s, "%d %s %lu %u", pid_nr(session->pid),
+			   session->comm, session->nr_bos, session->nr_cached);
+		total = 0;
+		for (i = 0; i < RKNPU_MEM_ACCT_NR; i++) {
+			seq_printf(s, " %llu", session->bytes[i]);
+			total += session->bytes[i];
+		}
+		seq_printf(s, " %llu\n", total);
+	}
+	spin_unlock(&rknpu_dev->lock);
+
 	return 0;
 }
@@ -4,9 +4,12 @@
  * Author: Felix Zeng <felix.zeng@rock-chips.com>
  */
 
+#include <linux/ctype.h>
 #include <linux/delay.h>
-#include <linux/iommu.h>
+#include <linux/of.h>
+#include <linux/seq_file.h>
 
+#include "rknpu_iommu.h"
 #include "rknpu_reset.h"
 
 static int rknpu_reset_assert(struct reset_control *rst)
@@ -41,6 +44,31 @@ static int rknpu_reset_deassert(struct reset_control *rst)
 	return 0;
 }
 
+/*
+ * Reset lines are named per core in the DT ("srst_a0", "srst_h1", ...), the
+ * trailing digit being the core. A line without one resets every core.
+ */
+static u32 rknpu_reset_core_mask(struct rknpu_device *rknpu_dev, int index)
+{
+	const char *name;
+	size_t len;
+	int core;
+
+	if (of_property_read_string_index(rknpu_dev->dev->of_node,
+					  "reset-names", index, &name))
+		return rknpu_dev->config->core_mask;
+
+	len = strlen(name);
+	if (!len || !isdigit(name[len - 1]))
+		return rknpu_dev->config->core_mask;
+
+	core = name[len - 1] - '0';
+	if (core >= rknpu_dev->config->num_irqs)
+		return rknpu_dev->config->core_mask;
+
+	return BIT(core);
+}
+
 int rknpu_reset_get(struct rknpu_device *rknpu_dev)
 {
 	int i, num_srsts;
@@ -58,6 +86,12 @@ int rknpu_reset_get(struct rknpu_device *rknpu_dev)
 	if (!rknpu_dev->srsts)
 		return -ENOMEM;
 
+	rknpu_dev->srst_core_masks =
+		devm_kcalloc(rknpu_dev->dev, num_srsts,
+			     sizeof(*rknpu_dev->srst_core_masks), GFP_KERNEL);
+	if (!rknpu_dev->srst_core_masks)
+		return -ENOMEM;
+
 	for (i = 0; i < num_srsts; ++i) {
 		rknpu_dev->srsts[i] = devm_reset_control_get_exclusive_by_index(
 			rknpu_dev->dev, i);
@@ -65,6 +99,8 @@ int rknpu_reset_get(struct rknpu_device *rknpu_dev)
 			rknpu_dev->num_srsts = i;
 			return PTR_ERR(rknpu_dev->srsts[i]);
 		}
+		rknpu_dev->srst_core_masks[i] =
+			rknpu_reset_core_mask(rknpu_dev, i);
 	}
 
 	rknpu_dev->num_srsts = num_srsts;
@@ -74,57 +110,116 @@ int rknpu_reset_get(struct rknpu_device *rknpu_dev)
 
 int rknpu_soft_reset(struct rknpu_device *rknpu_dev)
 {
-	struct iommu_domain *domain = NULL;
+	u32 core_mask = rknpu_dev->config->core_mask;
+
+	return rknpu_soft_reset_cores(rknpu_dev, &core_mask);
+}
+
+/*
+ * Reset the cores in @reset_mask and their MMUs; jobs on the other cores
+ * keep running. A reset line shared by several cores takes them all, so
+ * @reset_mask is widened to every core that went through the reset. It is
+ * cleared when resets are bypassed, as nothing was reset then. A reset
+ * that is already running is waited for, it may not cover these cores.
+ */
+int rknpu_soft_reset_cores(struct rknpu_device *rknpu_dev, u32 *reset_mask)
+{
 	struct rknpu_subcore_data *subcore_data = NULL;
+	u32 core_mask = *reset_mask;
+	unsigned long flags;
+	bool whole;
 	int ret = 0, i = 0;
 
 	if (rknpu_dev->bypass_soft_reset) {
 		LOG_WARN("bypass soft reset\n");
+		*reset_mask = 0;
 		return 0;
 	}
 
-	if (!mutex_trylock(&rknpu_dev->reset_lock))
-		return 0;
+	mutex_lock(&rknpu_dev->reset_lock);
 
-	rknpu_dev->soft_reseting = true;
+	for (i = 0; i < rknpu_dev->num_srsts; ++i) {
+		if (rknpu_dev->srst_core_masks[i] & core_mask)
+			core_mask |= rknpu_dev->srst_core_masks[i];
+	}
+	whole = core_mask == rknpu_dev->config->core_mask;
+	*reset_mask = core_mask;
+
+	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
+	rknpu_dev->soft_reseting = whole;
+	for (i = 0; i < rknpu_dev->config->num_irqs; ++i) {
+		if (core_mask & BIT(i))
+			rknpu_dev->subcore_datas[i].resetting = true;
+	}
+	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
 
 	msleep(100);
 
 	for (i = 0; i < rknpu_dev->config->num_irqs; ++i) {
 		subcore_data = &rknpu_dev->subcore_datas[i];
-		wake_up(&subcore_data->job_done_wq);
+		if (core_mask & BIT(i))
+			wake_up(&subcore_data->job_done_wq);
 	}
 
-	LOG_INFO("soft reset, num: %d\n", rknpu_dev->num_srsts);
+	LOG_INFO("soft reset, cores: %#x\n", core_mask);
 
-	for (i = 0; i < rknpu_dev->num_srsts; ++i)
-		ret |= rknpu_reset_assert(rknpu_dev->srsts[i]);
+	for (i = 0; i < rknpu_dev->num_srsts; ++i) {
+		if (rknpu_dev->srst_core_masks[i] & core_mask)
+			ret |= rknpu_reset_assert(rknpu_dev->srsts[i]);
+	}
 
 	udelay(10);
 
-	for (i = 0; i < rknpu_dev->num_srsts; ++i)
-		ret |= rknpu_reset_deassert(rknpu_dev->srsts[i]);
+	for (i = 0; i < rknpu_dev->num_srsts; ++i) {
+		if (rknpu_dev->srst_core_masks[i] & core_mask)
+			ret |= rknpu_reset_deassert(rknpu_dev->srsts[i]);
+	}
 
 	udelay(10);
 
-	if (ret) {
+	if (ret)
 		LOG_DEV_ERROR(rknpu_dev->dev,
 			      "failed to soft reset for rknpu: %d\n", ret);
-		mutex_unlock(&rknpu_dev->reset_lock);
-		return ret;
+	else
+		/* The MMUs of the reset cores come back with paging disabled */
+		rknpu_iommu_restore(rknpu_dev,
+				    core_mask & rknpu_core_power_mask(rknpu_dev));
+
+	/* Also on failure, or the cores would never take a job again */
+	spin_lock_irqsave(&rknpu_dev->irq_lock, flags);
+	rknpu_dev->soft_reseting = false;
+	for (i = 0; i < rknpu_dev->config->num_irqs; ++i) {
+		subcore_data = &rknpu_dev->subcore_datas[i];
+		if (core_mask & BIT(i)) {
+			subcore_data->resetting = false;
+			if (!ret)
+				subcore_data->resets++;
+		}
 	}
+	spin_unlock_irqrestore(&rknpu_dev->irq_lock, flags);
 
-	if (rknpu_dev->iommu_en)
-		domain = iommu_get_domain_for_dev(rknpu_dev->dev);
+	mutex_unlock(&rknpu_dev->reset_lock);
 
-	if (domain) {
-		iommu_detach_device(domain, rknpu_dev->dev);
-		iommu_attach_device(domain, rknpu_dev->dev);
-	}
+	return ret;
+}
 
-	rknpu_dev->soft_reseting = false;
+int rknpu_reset_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	int i;
 
-	mutex_unlock(&rknpu_dev->reset_lock);
+	if (!rknpu_dev)
+		return -ENODEV;
+
+	for (i = 0; i < rknpu_dev->num_srsts; ++i)
+		seq_printf(s, "srst%d: cores=%#x\n", i,
+			   rknpu_dev->srst_core_masks[i]);
+
+	for (i = 0; i < rknpu_dev->config->num_irqs; ++i)
+		seq_printf(s, "core%d: resets=%llu\n", i,
+			   rknpu_dev->subcore_datas[i].resets);
+
+	seq_printf(s, "inject_hang: %#lx\n", READ_ONCE(rknpu_dev->inject_hang));
 
 	return 0;
 }
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) Rockchip Electronics Co.Ltd
+ * Author: Felix Zeng <felix.zeng@rock-chips.com>
+ *
+ * On-chip SRAM allocator for RKNPU_MEM_TRY_ALLOC_SRAM buffers.
+ *
+ * RK3588 has a block of system SRAM that is much faster for the NPU than
+ * DDR. librknnrt asks for it with RKNPU_MEM_TRY_ALLOC_SRAM when creating
+ * internal (intermediate tensor) buffers. The region is described by a
+ * `rockchip,sram` phandle to a child of an mmio-sram node and handed out
+ * with genalloc. A BO gets as much of its head in SRAM as is free; the
+ * rest is DDR pages, and MEM_CREATE reports the split in sram_size.
+ *
+ * The NPU reaches SRAM through its IOMMU, so the region is only used in
+ * IOMMU mode. The kernel only maps the region to clear it on allocation,
+ * SRAM may hold data of another process or of another IP block.
+ *
+ * Without an SRAM node, sram_emulate_kb backs the allocator with normal
+ * memory so the placement, fallback and accounting can be exercised.
+ */
+
+#include <linux/genalloc.h>
+#include <linux/gfp.h>
+#include <linux/io.h>
+#include <linux/iommu.h>
+#include <linux/module.h>
+#include <linux/of.h>
+#include <linux/of_address.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "rknpu_drv.h"
+#include "rknpu_mem.h"
+#include "rknpu_sram.h"
+
+static unsigned int sram_emulate_kb;
+module_param(sram_emulate_kb, uint, 0444);
+MODULE_PARM_DESC(sram_emulate_kb,
+		 "back the SRAM allocator with this many KB of normal memory if the DT has no rockchip,sram node, 0 by default");
+
+static int rknpu_sram_get_region(struct rknpu_device *rknpu_dev,
+				 struct rknpu_sram *sram)
+{
+	struct device_node *node;
+	struct resource res;
+	int ret;
+
+	node = of_parse_phandle(rknpu_dev->dev->of_node, "rockchip,sram", 0);
+	if (node) {
+		ret = of_address_to_resource(node, 0, &res);
+		of_node_put(node);
+		if (ret) {
+			LOG_DEV_WARN(rknpu_dev->dev,
+				     "invalid rockchip,sram region: %d\n", ret);
+			return ret;
+		}
+
+		sram->start = res.start;
+		sram->size = resource_size(&res);
+		return 0;
+	}
+
+	if (!sram_emulate_kb)
+		return -ENODEV;
+
+	sram->size = (size_t)sram_emulate_kb << 10;
+	sram->emulated = alloc_pages_exact(sram->size,
+					   GFP_KERNEL | __GFP_ZERO);
+	if (!sram->emulated)
+		return -ENOMEM;
+	sram->start = virt_to_phys(sram->emulated);
+
+	return 0;
+}
+
+int rknpu_sram_init(struct rknpu_device *rknpu_dev)
+{
+	struct device *dev = rknpu_dev->dev;
+	struct rknpu_sram *sram;
+	phys_addr_t start;
+	int ret;
+
+	if (!rknpu_dev->iommu_en)
+		return 0;
+
+	sram = kzalloc(sizeof(*sram), GFP_KERNEL);
+	if (!sram)
+		return -ENOMEM;
+
+	ret = rknpu_sram_get_region(rknpu_dev, sram);
+	if (ret) {
+		kfree(sram);
+		/* SRAM is optional, TRY_ALLOC_SRAM then falls back to DDR */
+		return ret == -ENOMEM ? ret : 0;
+	}
+
+	/* The IOMMU can only map whole pages */
+	start = PAGE_ALIGN(sram->start);
+	sram->size = round_down(sram->start + sram->size - start, PAGE_SIZE);
+	sram->start = start;
+	if (!sram->size) {
+		LOG_DEV_WARN(dev, "sram region smaller than a page, ignored\n");
+		ret = 0;
+		goto err_free;
+	}
+
+	sram->scratch = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!sram->scratch) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	sram->pool = gen_pool_create(PAGE_SHIFT, -1);
+	if (!sram->pool) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	ret = gen_pool_add(sram->pool, sram->start, sram->size, -1);
+	if (ret)
+		goto err_free;
+
+	if (sram->emulated)
+		sram->base = (void __iomem __force *)phys_to_virt(sram->start);
+	else
+		sram->base = ioremap_wc(sram->start, sram->size);
+	if (!sram->base) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	spin_lock_init(&sram->lock);
+	rknpu_dev->sram = sram;
+
+	LOG_DEV_INFO(dev, "sram: %pa size %zu%s\n", &sram->start, sram->size,
+		     sram->emulated ? " (emulated)" : "");
+
+	return 0;
+
+err_free:
+	if (sram->pool)
+		gen_pool_destroy(sram->pool);
+	if (sram->scratch)
+		__free_page(sram->scratch);
+	if (sram->emulated)
+		free_pages_exact(sram->emulated,
+				 (size_t)sram_emulate_kb << 10);
+	kfree(sram);
+	return ret;
+}
+
+/* All SRAM BOs must have been released */
+void rknpu_sram_fini(struct rknpu_device *rknpu_dev)
+{
+	struct rknpu_sram *sram = rknpu_dev->sram;
+
+	if (!sram)
+		return;
+
+	rknpu_dev->sram = NULL;
+
+	gen_pool_destroy(sram->pool);
+	__free_page(sram->scratch);
+	if (sram->emulated)
+		free_pages_exact(sram->emulated,
+				 (size_t)sram_emulate_kb << 10);
+	else
+		iounmap(sram->base);
+	kfree(sram);
+}
+
+size_t rknpu_sram_total_size(struct rknpu_device *rknpu_dev)
+{
+	return rknpu_dev->sram ? gen_pool_size(rknpu_dev->sram->pool) : 0;
+}
+
+size_t rknpu_sram_free_size(struct rknpu_device *rknpu_dev)
+{
+	return rknpu_dev->sram ? gen_pool_avail(rknpu_dev->sram->pool) : 0;
+}
+
+/*
+ * Reserve up to @size bytes of SRAM. The largest page multiple that still
+ * fits is taken, halving on fragmentation. The memory is cleared. Returns
+ * the reserved size (0 if none) and its physical address in @phys.
+ */
+size_t rknpu_sram_alloc(struct rknpu_device *rknpu_dev, size_t size,
+			phys_addr_t *phys)
+{
+	struct rknpu_sram *sram = rknpu_dev->sram;
+	unsigned long addr = 0;
+	size_t used, len;
+
+	if (!sram)
+		return 0;
+
+	len = round_down(min(size, gen_pool_avail(sram->pool)), PAGE_SIZE);
+	while (len) {
+		addr = gen_pool_alloc(sram->pool, len);
+		if (addr)
+			break;
+		len = round_down(len / 2, PAGE_SIZE);
+	}
+
+	spin_lock(&sram->lock);
+	if (addr) {
+		sram->allocs++;
+		if (len < size)
+			sram->partial++;
+		used = gen_pool_size(sram->pool) - gen_pool_avail(sram->pool);
+		sram->peak = max(sram->peak, used);
+	} else {
+		sram->fallbacks++;
+	}
+	spin_unlock(&sram->lock);
+
+	if (!addr)
+		return 0;
+
+	memset_io(sram->base + (addr - sram->start), 0, len);
+	*phys = addr;
+
+	return len;
+}
+
+void rknpu_sram_free(struct rknpu_device *rknpu_dev, phys_addr_t phys,
+		     size_t size)
+{
+	gen_pool_free(rknpu_dev->sram->pool, phys, size);
+}
+
+/*
+ * Point the head of an already mapped BO at its SRAM. The page allocator
+ * maps the scratch page there so the IOVA range is reserved by iommu-dma
+ * and released again by dma_unmap_sgtable(), which unmaps the whole range
+ * whatever it points to.
+ */
+int rknpu_sram_map(struct rknpu_device *rknpu_dev,
+		   struct rknpu_mem_object *rknpu_obj)
+{
+	struct iommu_domain *domain = iommu_get_domain_for_dev(rknpu_dev->dev);
+	size_t unmapped;
+	int ret;
+
+	if (!domain)
+		return -ENODEV;
+
+	unmapped = iommu_unmap(domain, rknpu_obj->dma_addr,
+			       rknpu_obj->sram_size);
+	if (unmapped != rknpu_obj->sram_size) {
+		LOG_ERROR("sram: unmapped %zu of %zu bytes at %#llx\n",
+			  unmapped, rknpu_obj->sram_size,
+			  (u64)rknpu_obj->dma_addr);
+		return -EINVAL;
+	}
+
+	ret = iommu_map(domain, rknpu_obj->dma_addr, rknpu_obj->sram_phys,
+			rknpu_obj->sram_size, IOMMU_READ | IOMMU_WRITE,
+			GFP_KERNEL);
+	if (ret)
+		LOG_ERROR("sram: iommu_map of %zu bytes failed: %d\n",
+			  rknpu_obj->sram_size, ret);
+
+	return ret;
+}
+
+int rknpu_sram_debugfs_show(struct seq_file *s, void *unused)
+{
+	struct rknpu_device *rknpu_dev = s->private;
+	struct rknpu_sram *sram;
+
+	if (!rknpu_dev || !rknpu_dev->sram) {
+		seq_puts(s, "no sram\n");
+		return 0;
+	}
+
+	sram = rknpu_dev->sram;
+
+	seq_printf(s, "region: %pa %zu%s\n", &sram->start, sram->size,
+		   sram->emulated ? " (emulated)" : "");
+	seq_printf(s, "free: %zu / %zu\n", gen_pool_avail(sram->pool),
+		   gen_pool_size(sram->pool));
+
+	spin_lock(&sram->lock);
+	seq_printf(s, "peak: %zu\n", sram->peak);
+	seq_printf(s, "allocs: %llu\n", sram->allocs);
+	seq_printf(s, "partial: %llu\n", sram->partial);
+	seq_printf(s, "fallbacks: %llu\n", sram->fallbacks);
+	spin_unlock(&sram->lock);
+
+	return 0;
+}